@@ -1,5 +1,6 @@
 
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -7,13 +8,20 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 
 #define BS 4096u
 #define INODE_SIZE 128u
 #define ROOT_INO 1u
 #define DIRECT_MAX 12
+#define SB_FLAG_DIRHASH 0x1u    // finalized by vsfs_finalize: read-only
+#define SB_FLAG_INDIRECT 0x2u   // files may map blocks past direct[] (mkfs_builder --indirect)
+#define PTRS_PER_BLK (BS / 4u)
+#define MAP_MAX_BLOCKS (DIRECT_MAX + PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK)
 
 #pragma pack(push, 1)
 
@@ -115,31 +123,327 @@ static inline void set_bit(uint8_t* bmap, uint32_t idx){
     bmap[idx >> 3] |= (uint8_t)(1u << (idx & 7));
 }
 
-typedef struct { const char* in_img; const char* out_img; const char* filepath; } cli_t;
+//  Latency histograms: log-bucketed like HdrHistogram, 16 linear
+//  sub-buckets per power of two (<= 6.25% error), values in ns
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct { uint64_t n, max, sum; uint32_t b[HIST_BUCKETS]; } hist_t;
+
+static uint32_t hist_index(uint64_t v){
+    if(v < HIST_SUB) return (uint32_t)v;
+    uint32_t e = 63u - (uint32_t)__builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (uint32_t)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+// Highest value that lands in bucket i
+static uint64_t hist_bucket_max(uint32_t i){
+    if(i < HIST_SUB) return i;
+    uint32_t e = i / HIST_SUB + HIST_SUB_BITS - 1, sub = i % HIST_SUB;
+    uint64_t lo = (1ull << e) | ((uint64_t)sub << (e - HIST_SUB_BITS));
+    return lo + (1ull << (e - HIST_SUB_BITS)) - 1;
+}
+static void hist_record(hist_t* h, uint64_t v){
+    h->b[hist_index(v)]++;
+    h->n++;
+    h->sum += v;
+    if(v > h->max) h->max = v;
+}
+static uint64_t hist_percentile(const hist_t* h, double p){
+    if(!h->n) return 0;
+    uint64_t rank = (uint64_t)(p * (double)h->n + 0.999999);
+    if(rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for(uint32_t i=0;i<HIST_BUCKETS;i++){
+        seen += h->b[i];
+        if(seen >= rank){ uint64_t v = hist_bucket_max(i); return v < h->max ? v : h->max; }
+    }
+    return h->max;
+}
+static double now_ns(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//  --stats: phase timings, I/O counters and per-operation latencies
+
+enum { PH_LOAD, PH_VALIDATE, PH_ALLOC, PH_COPY, PH_DIRENT, PH_CRC, PH_WRITE, PH_COUNT };
+static const char* PHASE_NAMES[PH_COUNT] = { "load", "validate", "allocate", "copy", "dirent", "crc", "write" };
+enum { OP_ADD, OP_READ, OP_LOOKUP, OP_COMMIT, OP_COUNT };
+static const char* OP_NAMES[OP_COUNT] = { "add", "read", "lookup", "commit" };
+
+typedef struct {
+    double   phase_ms[PH_COUNT];
+    int      phase;            // phase being timed
+    double   phase_t0;
+    uint64_t bytes_read, bytes_written;
+    uint64_t n_open, n_read, n_write, n_stat;  // I/O calls issued (stdio calls count once)
+    uint64_t blocks_dirtied;
+    uint64_t bits_scanned;     // test_bit calls in the allocator scans
+    hist_t   lat[OP_COUNT];
+} stats_t;
+
+static double now_ms(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+// Closes the current phase, starts `ph`, returns the one that was running
+static int stats_phase(stats_t* st, int ph){
+    double t = now_ms();
+    int prev = st->phase;
+    st->phase_ms[prev] += t - st->phase_t0;
+    st->phase = ph; st->phase_t0 = t;
+    return prev;
+}
+
+static void stats_print(stats_t* st, int json){
+    stats_phase(st, st->phase);
+    struct rusage ru; getrusage(RUSAGE_SELF, &ru);
+    double total = 0;
+    for(int i=0;i<PH_COUNT;i++) total += st->phase_ms[i];
+    if(json){
+        fprintf(stderr,"{\"phases_ms\":{");
+        for(int i=0;i<PH_COUNT;i++) fprintf(stderr,"%s\"%s\":%.3f", i?",":"", PHASE_NAMES[i], st->phase_ms[i]);
+        fprintf(stderr,"},\"total_ms\":%.3f,\"bytes_read\":%" PRIu64 ",\"bytes_written\":%" PRIu64
+                ",\"calls\":{\"open\":%" PRIu64 ",\"read\":%" PRIu64 ",\"write\":%" PRIu64 ",\"stat\":%" PRIu64 "}"
+                ",\"blocks_dirtied\":%" PRIu64 ",\"bits_scanned\":%" PRIu64 ",\"peak_rss_kib\":%ld,"
+                "\"page_faults\":{\"minor\":%ld,\"major\":%ld},",
+                total, st->bytes_read, st->bytes_written, st->n_open, st->n_read, st->n_write, st->n_stat,
+                st->blocks_dirtied, st->bits_scanned, ru.ru_maxrss, ru.ru_minflt, ru.ru_majflt);
+        fprintf(stderr,"\"latency_us\":{");
+        for(int i=0;i<OP_COUNT;i++){
+            const hist_t* h = &st->lat[i];
+            fprintf(stderr,"%s\"%s\":{\"n\":%" PRIu64 ",\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+                    i?",":"", OP_NAMES[i], h->n, hist_percentile(h,0.50)/1e3, hist_percentile(h,0.99)/1e3,
+                    hist_percentile(h,0.999)/1e3, h->max/1e3);
+        }
+        fprintf(stderr,"}}\n");
+        return;
+    }
+    fprintf(stderr,"stats:");
+    for(int i=0;i<PH_COUNT;i++) fprintf(stderr," %s %.3f ms,", PHASE_NAMES[i], st->phase_ms[i]);
+    fprintf(stderr," total %.3f ms\n", total);
+    fprintf(stderr,"stats: read %" PRIu64 " B, written %" PRIu64 " B, calls open=%" PRIu64 " read=%" PRIu64
+            " write=%" PRIu64 " stat=%" PRIu64 "\n", st->bytes_read, st->bytes_written,
+            st->n_open, st->n_read, st->n_write, st->n_stat);
+    fprintf(stderr,"stats: blocks dirtied %" PRIu64 ", bitmap bits scanned %" PRIu64 ", peak RSS %ld KiB\n",
+            st->blocks_dirtied, st->bits_scanned, ru.ru_maxrss);
+    fprintf(stderr,"stats: page faults minor %ld, major %ld\n", ru.ru_minflt, ru.ru_majflt);
+    for(int i=0;i<OP_COUNT;i++){
+        const hist_t* h = &st->lat[i];
+        if(!h->n) continue;
+        fprintf(stderr,"stats: latency %-6s n=%" PRIu64 " p50=%.3f us p99=%.3f us p999=%.3f us max=%.3f us\n",
+                OP_NAMES[i], h->n, hist_percentile(h,0.50)/1e3, hist_percentile(h,0.99)/1e3,
+                hist_percentile(h,0.999)/1e3, h->max/1e3);
+    }
+}
+
+//  --prom-textfile: free space of the output image and op latencies in the
+//  Prometheus text format, for node_exporter's textfile collector
+
+static void prom_label(FILE* f, const char* v){
+    for(; *v; v++){
+        if(*v=='\\' || *v=='"') fputc('\\', f);
+        if(*v=='\n'){ fputs("\\n", f); continue; }
+        fputc(*v, f);
+    }
+}
+
+// Written to a temp file and renamed, so the collector never reads half a file
+static int prom_write(const char* path, const char* image, const superblock_t* sb,
+                      const uint8_t* inode_bmap, const uint8_t* data_bmap, const hist_t* lat){
+    uint64_t free_inodes = 0, free_blocks = 0, extents = 0, largest = 0, run = 0;
+    for(uint32_t i=0;i<(uint32_t)sb->inode_count;i++) free_inodes += !test_bit(inode_bmap, i);
+    for(uint32_t i=0;i<=(uint32_t)sb->data_region_blocks;i++){
+        if(i < sb->data_region_blocks && !test_bit(data_bmap, i)){ run++; free_blocks++; continue; }
+        if(run){ extents++; if(run > largest) largest = run; }
+        run = 0;
+    }
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if(fd < 0){ perror("prom textfile"); return -1; }
+    FILE* f = fdopen(fd, "w");
+    if(!f){ close(fd); unlink(tmp); return -1; }
+
+    const char* names[] = { "vsfs_inodes", "vsfs_free_inodes", "vsfs_data_blocks", "vsfs_free_blocks",
+                            "vsfs_free_extents", "vsfs_largest_free_extent_blocks" };
+    const char* helps[] = { "Inodes in the image.", "Free inodes in the image.", "Blocks in the data region.",
+                            "Free data blocks.", "Runs of free data blocks.", "Longest run of free data blocks." };
+    uint64_t vals[] = { sb->inode_count, free_inodes, sb->data_region_blocks, free_blocks, extents, largest };
+    for(int k=0;k<6;k++){
+        fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s{image=\"", names[k], helps[k], names[k], names[k]);
+        prom_label(f, image);
+        fprintf(f, "\"} %" PRIu64 "\n", vals[k]);
+    }
+    fprintf(f, "# HELP vsfs_free_space_fragmentation 1 - largest free run / free blocks.\n"
+               "# TYPE vsfs_free_space_fragmentation gauge\nvsfs_free_space_fragmentation{image=\"");
+    prom_label(f, image);
+    fprintf(f, "\"} %.6f\n", free_blocks ? 1.0 - (double)largest / (double)free_blocks : 0.0);
+
+    // same decade buckets as mkfs_builder's textfile
+    static const double LE_S[] = { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1, 10 };
+    fprintf(f, "# HELP vsfs_op_latency_seconds Per-operation latency.\n"
+               "# TYPE vsfs_op_latency_seconds histogram\n");
+    for(int op=0; op<OP_COUNT; op++){
+        const hist_t* h = &lat[op];
+        for(size_t k=0;k<sizeof(LE_S)/sizeof(LE_S[0]);k++){
+            uint64_t le_ns = (uint64_t)(LE_S[k] * 1e9), cum = 0;
+            for(uint32_t i=0;i<HIST_BUCKETS && hist_bucket_max(i) <= le_ns;i++) cum += h->b[i];
+            fprintf(f, "vsfs_op_latency_seconds_bucket{op=\"%s\",le=\"%g\"} %" PRIu64 "\n", OP_NAMES[op], LE_S[k], cum);
+        }
+        fprintf(f, "vsfs_op_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", OP_NAMES[op], h->n);
+        fprintf(f, "vsfs_op_latency_seconds_sum{op=\"%s\"} %.9f\n", OP_NAMES[op], h->sum / 1e9);
+        fprintf(f, "vsfs_op_latency_seconds_count{op=\"%s\"} %" PRIu64 "\n", OP_NAMES[op], h->n);
+    }
+    fprintf(f, "# HELP vsfs_last_update_timestamp_seconds When this file was written.\n"
+               "# TYPE vsfs_last_update_timestamp_seconds gauge\nvsfs_last_update_timestamp_seconds %lld\n",
+               (long long)time(NULL));
+
+    int ok = fflush(f)==0 && fchmod(fileno(f), 0644)==0;
+    if(fclose(f)!=0) ok = 0;
+    if(!ok || rename(tmp, path)!=0){ perror("prom textfile"); unlink(tmp); return -1; }
+    return 0;
+}
+
+//  Working image. --memfd[=huge]: an anonymous memfd (tmpfs pages, or
+//  hugetlbfs with =huge) instead of the heap; nothing touches disk until the
+//  output image is exported at the end. --mmap maps the input copy-on-write
+//  instead of reading it. --thp / --populate cut 4 KiB first-touch faults.
+
+// Zero-filled; *map_len is the mapping size, 0 if the buffer came from the heap.
+// thp: an anonymous 2 MiB-aligned mapping with MADV_HUGEPAGE instead of calloc.
+static uint8_t* img_alloc(size_t bytes, int memfd, int thp, size_t* map_len){
+    *map_len = 0;
+#ifdef __linux__
+    const size_t HP = 2u << 20;
+    for(int huge = memfd == 2; memfd && huge >= 0; huge--){
+        size_t len = huge ? (bytes + HP - 1) & ~(HP - 1) : bytes;
+        int fd = memfd_create("mvsfs-image", MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0));
+        if(fd >= 0 && ftruncate(fd, (off_t)len)==0){
+            void* p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if(p != MAP_FAILED){
+                if(thp && !huge) madvise(p, len, MADV_HUGEPAGE);   // shmem THP, if enabled for tmpfs
+                *map_len = len; return (uint8_t*)p;
+            }
+        } else if(fd >= 0) close(fd);
+        fprintf(stderr,"memfd%s: %s, %s\n", huge ? " (hugetlb)" : "", strerror(errno),
+                huge ? "using normal pages" : "using the heap");
+    }
+    if(thp){
+        size_t len = (bytes + HP - 1) & ~(HP - 1);
+        uint8_t* raw = (uint8_t*)mmap(NULL, len + HP, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(raw != MAP_FAILED){
+            // trim to a 2 MiB boundary so whole huge pages fit
+            uint8_t* p = (uint8_t*)(((uintptr_t)raw + HP - 1) & ~(uintptr_t)(HP - 1));
+            if(p > raw) munmap(raw, (size_t)(p - raw));
+            if(raw + len + HP > p + len) munmap(p + len, (size_t)(raw + len + HP - (p + len)));
+            if(madvise(p, len, MADV_HUGEPAGE) != 0) perror("madvise(MADV_HUGEPAGE)");
+            *map_len = len; return p;
+        }
+        perror("mmap --thp");
+    }
+#else
+    if(memfd || thp) fprintf(stderr,"--memfd/--thp need Linux, using the heap\n");
+#endif
+    return (uint8_t*)calloc(1, bytes);
+}
+static void img_free(uint8_t* p, size_t map_len){
+#ifdef __linux__
+    if(map_len){ munmap(p, map_len); return; }
+#endif
+    free(p);
+}
+
+// --populate: fault in [off, off+len) of the buffer now (the metadata blocks),
+// so the build or add itself doesn't stop on first-touch faults
+static void img_prefault(uint8_t* img, size_t off, size_t len){
+    long pg = sysconf(_SC_PAGESIZE);
+    uint8_t* a = (uint8_t*)((uintptr_t)(img + off) & ~(uintptr_t)(pg - 1));
+    len += (size_t)(img + off - a);
+#if defined(__linux__) && defined(MADV_POPULATE_WRITE)
+    if(madvise(a, len, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    // write-touch each page; a no-op store still forces the page (or its COW copy) in
+    for(size_t o=0; o<len; o+=(size_t)pg){ volatile uint8_t* q = a + o; *q = *q; }
+}
+
+enum { PLACE_FIRST_FIT, PLACE_DIRENT };
+
+typedef struct {
+    const char* in_img; const char* out_img;
+    const char** files; int nfiles;   // --file, repeatable: added in order, written out once
+    int stats; const char* prom;
+    int memfd;                        // 1: --memfd, 2: --memfd=huge
+    int map, thp, populate;           // --mmap the input / huge-page hint / prefault metadata
+    int placement;                    // PLACE_*
+} cli_t;
 
 static int parse_cli(int argc, char** argv, cli_t* c){
     memset(c, 0, sizeof(*c));
+    c->files = (const char**)calloc((size_t)argc, sizeof(*c->files));
+    if(!c->files) return -1;
     for(int i=1;i<argc;i++){
         if(!strcmp(argv[i],"--input") && i+1<argc) c->in_img = argv[++i];
         else if(!strcmp(argv[i],"--output") && i+1<argc) c->out_img = argv[++i];
-        else if(!strcmp(argv[i],"--file") && i+1<argc) c->filepath = argv[++i];
+        else if(!strcmp(argv[i],"--file") && i+1<argc) c->files[c->nfiles++] = argv[++i];
+        else if(!strcmp(argv[i],"--stats")) c->stats = 1;
+        else if(!strcmp(argv[i],"--stats=json")) c->stats = 2;
+        else if(!strcmp(argv[i],"--prom-textfile") && i+1<argc) c->prom = argv[++i];
+        else if(!strcmp(argv[i],"--memfd")) c->memfd = 1;
+        else if(!strcmp(argv[i],"--memfd=huge")) c->memfd = 2;
+        else if(!strcmp(argv[i],"--mmap")) c->map = 1;
+        else if(!strcmp(argv[i],"--thp")) c->thp = 1;
+        else if(!strcmp(argv[i],"--populate")) c->populate = 1;
+        else if(!strcmp(argv[i],"--placement") && i+1<argc){
+            const char* o = argv[++i];
+            if(!strcmp(o,"first-fit")) c->placement = PLACE_FIRST_FIT;
+            else if(!strcmp(o,"dirent")) c->placement = PLACE_DIRENT;
+            else { fprintf(stderr,"--placement must be first-fit or dirent\n"); return -1; }
+        }
         else { fprintf(stderr,"Unknown/invalid arg: %s\n", argv[i]); return -1; }
     }
-    if(!c->in_img || !c->out_img || !c->filepath){
-        fprintf(stderr,"Usage: --input <img> --output <img> --file <path>\n");
+    if(!c->in_img || !c->out_img || !c->nfiles){
+        fprintf(stderr,"Usage: --input <img> --output <img> --file <path> [--file <path>]... [--memfd[=huge] | --mmap]"
+                       " [--thp] [--populate] [--placement first-fit|dirent] [--stats[=json]] [--prom-textfile <path>]\n");
         return -1;
     }
+    if(c->map && c->memfd){ fprintf(stderr,"Use only one of --memfd / --mmap\n"); return -1; }
     return 0;
 }
 
-static int read_entire(FILE* f, uint8_t** buf_out, size_t* bytes_out){
+static int read_entire(FILE* f, uint8_t** buf_out, size_t* bytes_out, size_t* map_len, const cli_t* c, stats_t* st){
     if(fseek(f, 0, SEEK_END)!=0) return -1;
     long sz = ftell(f);
     if(sz<0) return -1;
     if(fseek(f, 0, SEEK_SET)!=0) return -1;
-    uint8_t* b = (uint8_t*)malloc((size_t)sz);
+#ifdef __linux__
+    // Unwritten pages of a private mapping still come from the input file, so
+    // an in-place add (--output is the input) would truncate them away on export
+    struct stat in_st, out_st;
+    int in_place = fstat(fileno(f), &in_st)==0 && stat(c->out_img, &out_st)==0 &&
+                   in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino;
+    if(c->map && sz > 0 && in_place) fprintf(stderr,"--mmap: --output is the input image, reading it instead\n");
+    else if(c->map && sz > 0){
+        // private mapping: edits stay in memory, the input file is never written
+        void* m = mmap(NULL, (size_t)sz, PROT_READ|PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+        if(m != MAP_FAILED){
+            if(c->thp) madvise(m, (size_t)sz, MADV_HUGEPAGE);
+            *buf_out = (uint8_t*)m; *bytes_out = *map_len = (size_t)sz;
+            st->n_read++;
+            return 0;
+        }
+        perror("mmap --input, reading it instead");
+    }
+#endif
+    uint8_t* b = img_alloc(sz ? (size_t)sz : 1, c->memfd, c->thp, map_len);
     if(!b) return -1;
-    if(fread(b,1,(size_t)sz,f)!=(size_t)sz){ free(b); return -1; }
+    st->n_read++;
+    if(fread(b,1,(size_t)sz,f)!=(size_t)sz){ img_free(b, *map_len); return -1; }
+    st->bytes_read += (uint64_t)sz;
     *buf_out = b; *bytes_out = (size_t)sz; return 0;
 }
 
@@ -152,70 +456,158 @@ static const char* base_name(const char* path){
     return s ? s+1 : path;
 }
 
-int main(int argc, char** argv){
-    crc32_init();
-    cli_t cli; if(parse_cli(argc, argv, &cli)!=0) return 2;
-
-    // Read input image
-    FILE* fi = fopen(cli.in_img, "rb");
-    if(!fi){ perror("fopen input"); return 1; }
-    uint8_t* img = NULL; size_t img_bytes = 0;
-    if(read_entire(fi, &img, &img_bytes)!=0){ fclose(fi); fprintf(stderr,"Failed to read input image\n"); return 1; }
-    fclose(fi);
+// Pointer blocks a file of nb blocks needs: reserved_0 is a single indirect
+// block (1024 block numbers), reserved_1 a double indirect one (1024 of those)
+static uint32_t map_blocks(uint32_t nb){
+    if(nb <= DIRECT_MAX) return 0;
+    nb -= DIRECT_MAX;
+    if(nb <= PTRS_PER_BLK) return 1;
+    nb -= PTRS_PER_BLK;
+    return 2 + (nb + PTRS_PER_BLK - 1) / PTRS_PER_BLK;
+}
 
-    if(img_bytes % BS){ fprintf(stderr,"Invalid image (size not multiple of block size)\n"); free(img); return 1; }
-    const uint64_t total_blocks = img_bytes / BS;
+// Fills in a file's block map. blks holds its nb data blocks in file order,
+// then map_blocks(nb) pointer blocks: the single indirect, the second-level
+// blocks of the double indirect, and last the double indirect itself.
+static void map_file(uint8_t* img, inode_t* ino, const uint32_t* blks, uint32_t nb){
+    uint32_t i = 0;
+    for(; i<nb && i<DIRECT_MAX; i++) ino->direct[i] = blks[i];
+    if(i == nb) return;
+    const uint32_t* p = blks + nb;
+    uint32_t* single = (uint32_t*)(img + BS * (uint64_t)p[0]);
+    memset(single, 0, BS);
+    ino->reserved_0 = *p++;
+    for(uint32_t k=0; k<PTRS_PER_BLK && i<nb; k++) single[k] = blks[i++];
+    if(i == nb) return;
+    uint32_t n2 = (nb - i + PTRS_PER_BLK - 1) / PTRS_PER_BLK;
+    uint32_t* dbl = (uint32_t*)(img + BS * (uint64_t)p[n2]);
+    memset(dbl, 0, BS);
+    ino->reserved_1 = p[n2];
+    for(uint32_t j=0; j<n2; j++){
+        uint32_t* l2 = (uint32_t*)(img + BS * (uint64_t)p[j]);
+        memset(l2, 0, BS);
+        dbl[j] = p[j];
+        for(uint32_t k=0; k<PTRS_PER_BLK && i<nb; k++) l2[k] = blks[i++];
+    }
+}
 
-    // Map SB and validate
-    superblock_t* sb = (superblock_t*)(img + BS*0);
-    if(sb->magic != 0x4D565346u || sb->version != 1 || sb->block_size != BS){
-        fprintf(stderr,"Not a MiniVSFS image\n"); free(img); return 3;
+// --placement dirent: where the new file's data should go so that reading /
+// in dirent order stays one forward sweep. The new dirent takes the first free
+// slot; the window runs from just past the data of the last file listed before
+// it to the first block of the next file listed after it (data-region relative).
+static void dirent_window(const uint8_t* img, const superblock_t* sb, const inode_t* itbl,
+                          uint32_t* goal, uint32_t* limit){
+    const inode_t* root = &itbl[0];
+    int past_slot = 0;
+    *goal = 0; *limit = (uint32_t)sb->data_region_blocks;
+    for(int d=0; d<DIRECT_MAX && root->direct[d]; d++){
+        const dirent64_t* de = (const dirent64_t*)(img + BS*root->direct[d]);
+        for(uint32_t i=0;i<BS/sizeof(dirent64_t);i++){
+            if(!de[i].inode_no){ past_slot = 1; continue; }
+            if(de[i].inode_no > sb->inode_count || de[i].type != 1) continue;
+            const inode_t* f = &itbl[de[i].inode_no - 1];
+            if(past_slot){
+                uint64_t b = f->direct[0];
+                if(b >= sb->data_region_start){ *limit = (uint32_t)(b - sb->data_region_start); return; }
+                continue;
+            }
+            // a file's pointer blocks follow its data, the double indirect last
+            const int nmap = (sb->flags & SB_FLAG_INDIRECT) ? DIRECT_MAX + 2 : DIRECT_MAX;
+            for(int k=0;k<nmap;k++){
+                uint64_t b = k < DIRECT_MAX ? f->direct[k] : k == DIRECT_MAX ? f->reserved_0 : f->reserved_1;
+                if(b >= sb->data_region_start && b + 1 - sb->data_region_start > *goal)
+                    *goal = (uint32_t)(b + 1 - sb->data_region_start);
+            }
+        }
     }
-    if(sb->total_blocks != total_blocks){
-        fprintf(stderr,"Superblock total_blocks mismatch\n"); free(img); return 3;
+}
+
+// One run of n free blocks: inside [goal, limit), else at or after goal, else
+// anywhere. Returns 0 if there is none.
+static int alloc_run(const uint8_t* data_bmap, uint32_t nblocks, uint32_t goal, uint32_t limit,
+                     uint32_t n, uint32_t* out, uint64_t* scanned){
+    const uint32_t from[3] = { goal, goal, 0 };
+    const uint32_t to[3]   = { limit < nblocks ? limit : nblocks, nblocks, nblocks };
+    for(int pass=0; pass<3; pass++){
+        uint32_t run = 0;
+        for(uint32_t i=from[pass]; i<to[pass]; i++){
+            (*scanned)++;
+            if(test_bit(data_bmap, i)){ run = 0; continue; }
+            if(++run == n){
+                for(uint32_t k=0;k<n;k++) out[k] = i + 1 - n + k;
+                return 1;
+            }
+        }
     }
+    return 0;
+}
 
+// Adds one host file into / of the in-memory image. Returns 0 and the new
+// inode number, or the exit code for the failure (the image is then not written).
+static int add_file(uint8_t* img, superblock_t* sb, const char* filepath, int placement, stats_t* st, uint32_t* ino_out){
+    double t_add = now_ns();
     uint8_t* inode_bmap = img + BS * sb->inode_bitmap_start;
     uint8_t* data_bmap  = img + BS * sb->data_bitmap_start;
     inode_t* itbl       = (inode_t*)(img + BS * sb->inode_table_start);
 
     // Read a file to add to the FS
-    struct stat st;
-    if(stat(cli.filepath,&st)!=0){ perror("stat --file"); free(img); return 4; }
-    if(!S_ISREG(st.st_mode)){ fprintf(stderr,"--file must be a regular file\n"); free(img); return 4; }
-    uint64_t fsize = (uint64_t)st.st_size;
+    struct stat fst;
+    st->n_stat++;
+    if(stat(filepath,&fst)!=0){ perror(filepath); return 4; }
+    if(!S_ISREG(fst.st_mode)){ fprintf(stderr,"--file must be a regular file: %s\n", filepath); return 4; }
+    uint64_t fsize = (uint64_t)fst.st_size;
+    if(fsize > (uint64_t)MAP_MAX_BLOCKS * BS){ fprintf(stderr,"File too large for the block map: %s\n", filepath); return 5; }
     uint32_t need_blocks = (uint32_t)((fsize + BS - 1) / BS);
-    if(need_blocks > DIRECT_MAX){
-        fprintf(stderr,"File too large for 12 direct blocks (max 49152 bytes)\n"); free(img); return 5;
+    if(need_blocks > DIRECT_MAX && !(sb->flags & SB_FLAG_INDIRECT)){
+        fprintf(stderr,"File too large for 12 direct blocks (max 49152 bytes): %s\n", filepath); return 5;
     }
+    const uint32_t run_blocks = need_blocks + map_blocks(need_blocks);   // data, then pointer blocks
 
     // First free inode!!!
+    stats_phase(st, PH_ALLOC);
     
+    double t_op = now_ns();
     uint32_t new_ino_idx = UINT32_MAX;
     for(uint32_t i=0;i<(uint32_t)sb->inode_count;i++){
+        st->bits_scanned++;
         if(!test_bit(inode_bmap, i)){ new_ino_idx = i; break; }
     }
-    if(new_ino_idx==UINT32_MAX){ fprintf(stderr,"No free inodes\n"); free(img); return 6; }
+    hist_record(&st->lat[OP_LOOKUP], (uint64_t)(now_ns() - t_op));
+    if(new_ino_idx==UINT32_MAX){ fprintf(stderr,"No free inodes\n"); return 6; }
     uint32_t new_ino_no = new_ino_idx + 1;
 
     // First free data blocks in data region
     
     uint32_t* db_idxs = NULL;
     if(need_blocks){
-        db_idxs = (uint32_t*)malloc(sizeof(uint32_t)*need_blocks);
-        if(!db_idxs){ free(img); return 1; }
+        db_idxs = (uint32_t*)malloc(sizeof(uint32_t) * run_blocks);
+        if(!db_idxs){ fprintf(stderr,"Out of memory\n"); return 1; }
         uint32_t found=0;
-        for(uint32_t i=0;i<(uint32_t)sb->data_region_blocks && found<need_blocks;i++){
+        t_op = now_ns();
+        if(placement == PLACE_DIRENT){
+            uint32_t goal, limit;
+            dirent_window(img, sb, itbl, &goal, &limit);
+            if(alloc_run(data_bmap, (uint32_t)sb->data_region_blocks, goal, limit, run_blocks,
+                         db_idxs, &st->bits_scanned))
+                found = run_blocks;
+        }
+        // first fit, block by block (also the fallback when no single run is free)
+        for(uint32_t i=0;i<(uint32_t)sb->data_region_blocks && found<run_blocks;i++){
+            st->bits_scanned++;
             if(!test_bit(data_bmap, i)){ db_idxs[found++] = i; }
         }
-        if(found < need_blocks){
-            fprintf(stderr,"Not enough free data blocks\n"); free(db_idxs); free(img); return 6;
+        hist_record(&st->lat[OP_LOOKUP], (uint64_t)(now_ns() - t_op));
+        if(found < run_blocks){
+            fprintf(stderr,"Not enough free data blocks\n"); free(db_idxs); return 6;
         }
     }
 
     // Allocate bits
     set_bit(inode_bmap, new_ino_idx);
-    for(uint32_t i=0;i<need_blocks;i++) set_bit(data_bmap, db_idxs[i]);
+    for(uint32_t i=0;i<run_blocks;i++){
+        set_bit(data_bmap, db_idxs[i]);
+        db_idxs[i] += (uint32_t)sb->data_region_start;   // absolute from here on
+    }
 
     // Building inode
     inode_t* ino = &itbl[new_ino_idx];
@@ -225,40 +617,50 @@ int main(int argc, char** argv){
     ino->uid = 0; ino->gid = 0;
     ino->size_bytes = fsize;
     ino->atime = ino->mtime = ino->ctime = (uint64_t)time(NULL);
-    for(uint32_t i=0;i<need_blocks;i++){
-        ino->direct[i] = (uint32_t)(sb->data_region_start + db_idxs[i]);
-    }
+    if(need_blocks) map_file(img, ino, db_idxs, need_blocks);
+    stats_phase(st, PH_CRC);
     inode_crc_finalize(ino);
+    // inode bitmap, inode table block, plus data bitmap and the data and pointer blocks
+    st->blocks_dirtied += 2 + (need_blocks ? 1 + run_blocks : 0);
 
 
 
     // Write file data
+    stats_phase(st, PH_COPY);
     if(need_blocks){
-        FILE* ff = fopen(cli.filepath, "rb");
-        if(!ff){ perror("open --file"); free(db_idxs); free(img); return 4; }
+        FILE* ff = fopen(filepath, "rb");
+        st->n_open++;
+        if(!ff){ perror("open --file"); free(db_idxs); return 4; }
         for(uint32_t i=0;i<need_blocks;i++){
-            uint8_t* blk = img + BS * ino->direct[i];
+            uint8_t* blk = img + BS * (uint64_t)db_idxs[i];
             memset(blk, 0, BS);
             size_t toread = (i+1<need_blocks)? BS : (size_t)(fsize - (uint64_t)i*BS);
+            st->n_read++;
+            t_op = now_ns();
             if(toread>0 && fread(blk,1,toread,ff) != toread){
-                perror("read --file"); fclose(ff); free(db_idxs); free(img); return 4;
+                perror("read --file"); fclose(ff); free(db_idxs); return 4;
             }
+            hist_record(&st->lat[OP_READ], (uint64_t)(now_ns() - t_op));
+            st->bytes_read += toread;
         }
         fclose(ff);
     }
+    free(db_idxs);
 
 
 
     // Add directory entry into root dir
+    stats_phase(st, PH_DIRENT);
     inode_t* root = &itbl[0];                     // inode #1 number
     uint64_t now = (uint64_t)time(NULL);
-    const char* base = base_name(cli.filepath);
+    const char* base = base_name(filepath);
     char namebuf[58]; memset(namebuf, 0, sizeof(namebuf));
     size_t namelen = strlen(base);
     if(namelen > sizeof(namebuf)) namelen = sizeof(namebuf);
     memcpy(namebuf, base, namelen);
 
     int placed = 0;
+    t_op = now_ns();
     for(int d=0; d<DIRECT_MAX && !placed; d++){
         if(root->direct[d]==0) break;
         uint8_t* blk = img + BS*root->direct[d];
@@ -274,12 +676,16 @@ int main(int argc, char** argv){
                 root->size_bytes += sizeof(dirent64_t);
                 root->mtime = root->ctime = now;
                 root->links += 1; // per spec
+                int prev = stats_phase(st, PH_CRC);
                 inode_crc_finalize(root);
+                stats_phase(st, prev);
+                st->blocks_dirtied += 1 + (new_ino_idx / (BS/INODE_SIZE) != 0);  // dirent blk, root's itbl blk
                 placed = 1; break;
             }
         }
     }
     
+    hist_record(&st->lat[OP_LOOKUP], (uint64_t)(now_ns() - t_op));
     if(!placed){
         // now need to extend root with a new data block
         
@@ -289,17 +695,18 @@ int main(int argc, char** argv){
         }
         if(slot < 0){
             fprintf(stderr,"Root directory has no free direct pointer to extend\n");
-            free(db_idxs); free(img); return 7;
+            return 7;
         }
         
         // find a free data block
         uint32_t free_idx = UINT32_MAX;
         for(uint32_t i=0;i<(uint32_t)sb->data_region_blocks; i++){
+            st->bits_scanned++;
             if(!test_bit(data_bmap, i)){ free_idx = i; break; }
         }
         if(free_idx==UINT32_MAX){
             fprintf(stderr,"No free data blocks to extend root directory\n");
-            free(db_idxs); free(img); return 7;
+            return 7;
         }
         set_bit(data_bmap, free_idx);
         uint32_t abs = (uint32_t)(sb->data_region_start + free_idx);
@@ -317,21 +724,88 @@ int main(int argc, char** argv){
         root->size_bytes += sizeof(dirent64_t);
         root->mtime = root->ctime = now;
         root->links += 1;
+        stats_phase(st, PH_CRC);
         inode_crc_finalize(root);
+        // new dir block, root's itbl blk, data bitmap if the file had no blocks
+        st->blocks_dirtied += 1 + (new_ino_idx / (BS/INODE_SIZE) != 0) + (need_blocks == 0);
         placed = 1;
     }
+    hist_record(&st->lat[OP_ADD], (uint64_t)(now_ns() - t_add));
+    *ino_out = new_ino_no;
+    return 0;
+}
+
+int main(int argc, char** argv){
+    crc32_init();
+    cli_t cli; if(parse_cli(argc, argv, &cli)!=0) return 2;
+    stats_t st; memset(&st, 0, sizeof(st));
+    st.phase = PH_LOAD; st.phase_t0 = now_ms();
+
+    // Read input image
+    FILE* fi = fopen(cli.in_img, "rb");
+    st.n_open++;
+    if(!fi){ perror("fopen input"); return 1; }
+    uint8_t* img = NULL; size_t img_bytes = 0, map_len = 0;
+    if(read_entire(fi, &img, &img_bytes, &map_len, &cli, &st)!=0){ fclose(fi); fprintf(stderr,"Failed to read input image\n"); return 1; }
+    fclose(fi);
+    stats_phase(&st, PH_VALIDATE);
+
+    if(img_bytes % BS){ fprintf(stderr,"Invalid image (size not multiple of block size)\n"); img_free(img, map_len); return 1; }
+    const uint64_t total_blocks = img_bytes / BS;
+
+    // Map SB and validate
+    superblock_t* sb = (superblock_t*)(img + BS*0);
+    if(sb->magic != 0x4D565346u || sb->version != 1 || sb->block_size != BS){
+        fprintf(stderr,"Not a MiniVSFS image\n"); img_free(img, map_len); return 3;
+    }
+    if(sb->total_blocks != total_blocks){
+        fprintf(stderr,"Superblock total_blocks mismatch\n"); img_free(img, map_len); return 3;
+    }
+    if(sb->flags & SB_FLAG_DIRHASH){
+        fprintf(stderr,"Image is finalized (read-only); add files to the image it was made from\n"); img_free(img, map_len); return 3;
+    }
+
+    // Metadata is what every add scans and rewrites; the data region is only appended to
+    size_t meta_bytes = (size_t)sb->data_region_start * BS;
+    if(meta_bytes > img_bytes) meta_bytes = img_bytes;
+#ifdef __linux__
+    if(cli.map) madvise(img, meta_bytes, MADV_WILLNEED);
+#endif
+    if(cli.populate) img_prefault(img, 0, meta_bytes);
+
+    // Every --file goes into the in-memory image; only the final export writes
+    uint32_t* inos = (uint32_t*)calloc((size_t)cli.nfiles, sizeof(*inos));
+    if(!inos){ img_free(img, map_len); return 1; }
+    for(int k=0;k<cli.nfiles;k++){
+        int rc = add_file(img, sb, cli.files[k], cli.placement, &st, &inos[k]);
+        if(rc){ free(inos); img_free(img, map_len); return rc; }
+    }
 
     
     // Write output image
+    stats_phase(&st, PH_WRITE);
+#ifdef __linux__
+    if(cli.map) madvise(img, img_bytes, MADV_SEQUENTIAL);   // one front-to-back pass from here
+#endif
+    double t_op = now_ns();
     FILE* fo = fopen(cli.out_img, "wb");
-    if(!fo){ perror("fopen output"); free(db_idxs); free(img); return 1; }
+    st.n_open++;
+    if(!fo){ perror("fopen output"); free(inos); img_free(img, map_len); return 1; }
     size_t blocks_written = fwrite(img, BS, (size_t)total_blocks, fo);
     fclose(fo);
-    free(db_idxs); free(img);
+    hist_record(&st.lat[OP_COMMIT], (uint64_t)(now_ns() - t_op));
+    st.n_write++;
+    st.bytes_written += (uint64_t)blocks_written * BS;
+    if(blocks_written == total_blocks && cli.prom)
+        prom_write(cli.prom, cli.out_img, sb, img + BS * sb->inode_bitmap_start, img + BS * sb->data_bitmap_start, st.lat);
+    img_free(img, map_len);
     if(blocks_written != total_blocks){
-        fprintf(stderr,"Short write on output image\n"); return 1;
+        fprintf(stderr,"Short write on output image\n"); free(inos); return 1;
     }
-    fprintf(stdout,"Added '%s' (inode #%u) into '%s' -> '%s'\n",
-            base, new_ino_no, cli.in_img, cli.out_img);
+    for(int k=0;k<cli.nfiles;k++)
+        fprintf(stdout,"Added '%s' (inode #%u) into '%s' -> '%s'\n",
+                base_name(cli.files[k]), inos[k], cli.in_img, cli.out_img);
+    free(inos);
+    if(cli.stats) stats_print(&st, cli.stats == 2);
     return 0;
 }
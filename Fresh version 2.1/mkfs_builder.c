@@ -1,19 +1,38 @@
 
 
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <errno.h>
 #include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #define BS 4096u
 #define INODE_SIZE 128u
 #define ROOT_INO 1u
 #define DIRECT_MAX 12
+#define SB_FLAG_INDIRECT 0x2u   // files may map blocks past direct[] (see map_file)
+#define PTRS_PER_BLK (BS / 4u)
+#define MAP_MAX_BLOCKS (DIRECT_MAX + PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK)
 
 
 #pragma pack(push, 1)
@@ -119,9 +138,30 @@ static void dirent_checksum_finalize(dirent64_t* de) {
 static inline void set_bit(uint8_t* bmap, uint32_t idx){
     bmap[idx >> 3] |= (uint8_t)(1u << (idx & 7));
 }
+static inline int test_bit(const uint8_t* bmap, uint32_t idx){
+    return (bmap[idx >> 3] >> (idx & 7)) & 1u;
+}
 static inline void zero_block(void* p){ memset(p, 0, BS); }
 
-typedef struct { const char* image; uint32_t size_kib; uint32_t inodes; } cli_t;
+typedef struct {
+    const char* image; uint32_t size_kib; uint32_t inodes;
+    const char* from_dir;   // populate / from every regular file in a host dir
+    const char* manifest;   // ... or from a list of host paths, one per line
+    int plan;               // only print the minimal --size-kib/--inodes
+    const char* tmpl_dir;   // cache of pre-built empty images to clone from
+    const char* batch;      // job file: one set of the above args per line
+    uint32_t jobs, io_jobs; // build threads / concurrent image I/O in --batch
+    int stats;              // 1: --stats, 2: --stats=json
+    const char* trace;      // Chrome trace-event JSON output (VSFS_TRACE builds)
+    const char* prom;       // Prometheus textfile-collector output
+    uint32_t stripes, stripe_kib; // spread the data region over N files
+    uint32_t shards;        // hash files over N images behind a shard map
+    struct src_set* shard_src; // set by run_shards: this shard's files, already scanned (owned)
+    int memfd;              // 1: --memfd, 2: --memfd=huge
+    int thp, populate;      // huge-page hint / prefault the metadata blocks
+    int order_name;         // --order name: files sorted by name before placement
+    int indirect;           // SB_FLAG_INDIRECT: files larger than 12 blocks
+} cli_t;
 
 static int parse_cli(int argc, char** argv, cli_t* c){
     memset(c, 0, sizeof(*c));
@@ -129,21 +169,934 @@ static int parse_cli(int argc, char** argv, cli_t* c){
         if(!strcmp(argv[i],"--image") && i+1<argc) c->image = argv[++i];
         else if(!strcmp(argv[i],"--size-kib") && i+1<argc) c->size_kib = (uint32_t)strtoul(argv[++i],NULL,10);
         else if(!strcmp(argv[i],"--inodes") && i+1<argc) c->inodes = (uint32_t)strtoul(argv[++i],NULL,10);
+        else if(!strcmp(argv[i],"--from-dir") && i+1<argc) c->from_dir = argv[++i];
+        else if(!strcmp(argv[i],"--manifest") && i+1<argc) c->manifest = argv[++i];
+        else if(!strcmp(argv[i],"--plan")) c->plan = 1;
+        else if(!strcmp(argv[i],"--template-cache") && i+1<argc) c->tmpl_dir = argv[++i];
+        else if(!strcmp(argv[i],"--batch") && i+1<argc) c->batch = argv[++i];
+        else if(!strcmp(argv[i],"--jobs") && i+1<argc) c->jobs = (uint32_t)strtoul(argv[++i],NULL,10);
+        else if(!strcmp(argv[i],"--io-jobs") && i+1<argc) c->io_jobs = (uint32_t)strtoul(argv[++i],NULL,10);
+        else if(!strcmp(argv[i],"--stats")) c->stats = 1;
+        else if(!strcmp(argv[i],"--stats=json")) c->stats = 2;
+        else if(!strcmp(argv[i],"--trace") && i+1<argc) c->trace = argv[++i];
+        else if(!strcmp(argv[i],"--prom-textfile") && i+1<argc) c->prom = argv[++i];
+        else if(!strcmp(argv[i],"--stripes") && i+1<argc) c->stripes = (uint32_t)strtoul(argv[++i],NULL,10);
+        else if(!strcmp(argv[i],"--stripe-kib") && i+1<argc) c->stripe_kib = (uint32_t)strtoul(argv[++i],NULL,10);
+        else if(!strcmp(argv[i],"--shards") && i+1<argc) c->shards = (uint32_t)strtoul(argv[++i],NULL,10);
+        else if(!strcmp(argv[i],"--memfd")) c->memfd = 1;
+        else if(!strcmp(argv[i],"--memfd=huge")) c->memfd = 2;
+        else if(!strcmp(argv[i],"--thp")) c->thp = 1;
+        else if(!strcmp(argv[i],"--populate")) c->populate = 1;
+        else if(!strcmp(argv[i],"--indirect")) c->indirect = 1;
+        else if(!strcmp(argv[i],"--order") && i+1<argc){
+            const char* o = argv[++i];
+            if(!strcmp(o,"name")) c->order_name = 1;
+            else if(!strcmp(o,"given")) c->order_name = 0;
+            else { fprintf(stderr,"--order must be name or given\n"); return -1; }
+        }
         else { fprintf(stderr,"Unknown/invalid arg: %s\n", argv[i]); return -1; }
     }
+    if(c->batch) return 0;  // everything else comes from the job lines
+    if(c->stripe_kib && !c->stripes){ fprintf(stderr,"--stripe-kib needs --stripes\n"); return -1; }
+    if(c->stripes){
+        if(c->stripes < 2 || c->stripes > 16){ fprintf(stderr,"--stripes must be in [2..16]\n"); return -1; }
+        if(!c->stripe_kib) c->stripe_kib = 64;
+        if(c->stripe_kib < 4 || c->stripe_kib > 1024 || (c->stripe_kib % 4)!=0){
+            fprintf(stderr,"--stripe-kib must be in [4..1024] and multiple of 4\n"); return -1;
+        }
+    }
+    int populate = c->from_dir || c->manifest;
+    if(c->from_dir && c->manifest){ fprintf(stderr,"Use only one of --from-dir / --manifest\n"); return -1; }
+    if(c->shards){
+        if(c->shards < 2 || c->shards > 64){ fprintf(stderr,"--shards must be in [2..64]\n"); return -1; }
+        if(!populate || c->plan){ fprintf(stderr,"--shards needs --from-dir or --manifest (and no --plan)\n"); return -1; }
+    }
+    if(c->plan){
+        if(!populate){ fprintf(stderr,"--plan needs --from-dir or --manifest\n"); return -1; }
+        c->size_kib = c->inodes = 0;  // always the minimum
+        return 0;
+    }
     if(!c->image){ fprintf(stderr,"Missing --image\n"); return -1; }
-    if(c->size_kib < 180 || c->size_kib > 4096 || (c->size_kib % 4)!=0){
+    // when populating both are optional, 0 means "size it from the files"
+    if((c->size_kib || !populate) &&
+       (c->size_kib < 180 || c->size_kib > 4096 || (c->size_kib % 4)!=0)){
         fprintf(stderr,"--size-kib must be in [180..4096] and multiple of 4\n"); return -1;
     }
-    if(c->inodes < 128 || c->inodes > 512){
+    if((c->inodes || !populate) && (c->inodes < 128 || c->inodes > 512)){
         fprintf(stderr,"--inodes must be in [128..512]\n"); return -1;
     }
     return 0;
 }
 
-int main(int argc, char** argv){
-    crc32_init();
-    cli_t cli; if(parse_cli(argc, argv, &cli)!=0) return 2;
+//  Latency histograms: log-bucketed like HdrHistogram, 16 linear
+//  sub-buckets per power of two (<= 6.25% error), values in ns
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct { uint64_t n, max, sum; uint32_t b[HIST_BUCKETS]; } hist_t;
+
+static uint32_t hist_index(uint64_t v){
+    if(v < HIST_SUB) return (uint32_t)v;
+    uint32_t e = 63u - (uint32_t)__builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (uint32_t)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+// Highest value that lands in bucket i
+static uint64_t hist_bucket_max(uint32_t i){
+    if(i < HIST_SUB) return i;
+    uint32_t e = i / HIST_SUB + HIST_SUB_BITS - 1, sub = i % HIST_SUB;
+    uint64_t lo = (1ull << e) | ((uint64_t)sub << (e - HIST_SUB_BITS));
+    return lo + (1ull << (e - HIST_SUB_BITS)) - 1;
+}
+static void hist_record(hist_t* h, uint64_t v){
+    h->b[hist_index(v)]++;
+    h->n++;
+    h->sum += v;
+    if(v > h->max) h->max = v;
+}
+static uint64_t hist_percentile(const hist_t* h, double p){
+    if(!h->n) return 0;
+    uint64_t rank = (uint64_t)(p * (double)h->n + 0.999999);
+    if(rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for(uint32_t i=0;i<HIST_BUCKETS;i++){
+        seen += h->b[i];
+        if(seen >= rank){ uint64_t v = hist_bucket_max(i); return v < h->max ? v : h->max; }
+    }
+    return h->max;
+}
+static double now_ns(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+static void hist_merge(hist_t* into, const hist_t* from){
+    for(uint32_t i=0;i<HIST_BUCKETS;i++) into->b[i] += from->b[i];
+    into->n += from->n;
+    into->sum += from->sum;
+    if(from->max > into->max) into->max = from->max;
+}
+
+//  --stats: phase timings, I/O counters and per-operation latencies, one
+//  set per built image
+
+enum { PH_LOAD, PH_VALIDATE, PH_ALLOC, PH_COPY, PH_DIRENT, PH_CRC, PH_WRITE, PH_COUNT };
+static const char* PHASE_NAMES[PH_COUNT] = { "load", "validate", "allocate", "copy", "dirent", "crc", "write" };
+enum { OP_ADD, OP_READ, OP_LOOKUP, OP_COMMIT, OP_FSYNC, OP_COUNT };
+static const char* OP_NAMES[OP_COUNT] = { "add", "read", "lookup", "commit", "fsync" };
+
+typedef struct {
+    double   phase_ms[PH_COUNT];
+    int      phase;            // phase being timed
+    double   phase_t0;
+    uint64_t bytes_read, bytes_written;
+    uint64_t n_open, n_read, n_write, n_stat;  // I/O calls issued (stdio calls count once)
+    uint64_t blocks_dirtied;
+    uint64_t bits_scanned;     // always 0 here: placement is planned, not searched
+    hist_t   lat[OP_COUNT];    // add: one --from-dir file, lookup: template cache probe
+    long     minflt0, majflt0; // page faults of this thread when the build started
+} stats_t;
+
+// Builds run one per thread, so per-thread counts are per image (Linux);
+// elsewhere they are per process
+static void thread_faults(long* minflt, long* majflt){
+    struct rusage ru;
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &ru);
+#else
+    getrusage(RUSAGE_SELF, &ru);
+#endif
+    *minflt = ru.ru_minflt; *majflt = ru.ru_majflt;
+}
+
+// Every build's latencies also land here so --batch --stats can report the whole run
+static hist_t          batch_lat[OP_COUNT];
+static pthread_mutex_t batch_lat_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static void batch_lat_merge(const stats_t* st){
+    pthread_mutex_lock(&batch_lat_mu);
+    for(int i=0;i<OP_COUNT;i++) hist_merge(&batch_lat[i], &st->lat[i]);
+    pthread_mutex_unlock(&batch_lat_mu);
+}
+
+static double now_ms(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+// Closes the current phase, starts `ph`, returns the one that was running
+static int stats_phase(stats_t* st, int ph){
+    double t = now_ms();
+    int prev = st->phase;
+    st->phase_ms[prev] += t - st->phase_t0;
+    st->phase = ph; st->phase_t0 = t;
+    return prev;
+}
+
+static void bprintf(char* buf, size_t cap, size_t* n, const char* fmt, ...){
+    va_list ap; va_start(ap, fmt);
+    int k = vsnprintf(buf + *n, cap - *n, fmt, ap);
+    va_end(ap);
+    if(k > 0) *n = *n + (size_t)k < cap ? *n + (size_t)k : cap - 1;
+}
+
+// JSON string contents: escapes quote, backslash and control characters
+static void bjson_str(char* buf, size_t cap, size_t* n, const char* v){
+    for(; *v; v++){
+        unsigned char c = (unsigned char)*v;
+        if(c=='"' || c=='\\') bprintf(buf, cap, n, "\\%c", c);
+        else if(c < 0x20) bprintf(buf, cap, n, "\\u%04x", c);
+        else bprintf(buf, cap, n, "%c", c);
+    }
+}
+
+static void lat_format(char* buf, size_t cap, size_t* n, const hist_t* lat, int json){
+    if(json) bprintf(buf, cap, n, "\"latency_us\":{");
+    int first = 1;
+    for(int i=0;i<OP_COUNT;i++){
+        const hist_t* h = &lat[i];
+        double p50 = hist_percentile(h,0.50)/1e3, p99 = hist_percentile(h,0.99)/1e3;
+        double p999 = hist_percentile(h,0.999)/1e3;
+        if(json){
+            bprintf(buf, cap, n, "%s\"%s\":{\"n\":%" PRIu64 ",\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+                    first ? "" : ",", OP_NAMES[i], h->n, p50, p99, p999, h->max/1e3);
+            first = 0;
+        } else if(h->n){
+            bprintf(buf, cap, n, "stats: latency %-6s n=%" PRIu64 " p50=%.3f us p99=%.3f us p999=%.3f us max=%.3f us\n",
+                    OP_NAMES[i], h->n, p50, p99, p999, h->max/1e3);
+        }
+    }
+    if(json) bprintf(buf, cap, n, "}");
+}
+
+// Formats the whole report first so --batch threads print it in one piece.
+// Peak RSS is per process, so in --batch it covers every job so far.
+static void stats_print(stats_t* st, int json, const char* image){
+    stats_phase(st, st->phase);
+    struct rusage ru; getrusage(RUSAGE_SELF, &ru);
+    long minflt, majflt;
+    thread_faults(&minflt, &majflt);
+    minflt -= st->minflt0; majflt -= st->majflt0;
+    double total = 0;
+    for(int i=0;i<PH_COUNT;i++) total += st->phase_ms[i];
+    char buf[4096]; size_t n = 0;
+#define OUT(...) bprintf(buf, sizeof(buf), &n, __VA_ARGS__)
+    if(json){
+        OUT("{\"image\":\"");
+        bjson_str(buf, sizeof(buf), &n, image);
+        OUT("\",\"phases_ms\":{");
+        for(int i=0;i<PH_COUNT;i++) OUT("%s\"%s\":%.3f", i?",":"", PHASE_NAMES[i], st->phase_ms[i]);
+        OUT("},\"total_ms\":%.3f,\"bytes_read\":%" PRIu64 ",\"bytes_written\":%" PRIu64
+            ",\"calls\":{\"open\":%" PRIu64 ",\"read\":%" PRIu64 ",\"write\":%" PRIu64 ",\"stat\":%" PRIu64 "}"
+            ",\"blocks_dirtied\":%" PRIu64 ",\"bits_scanned\":%" PRIu64 ",\"peak_rss_kib\":%ld,"
+            "\"page_faults\":{\"minor\":%ld,\"major\":%ld},",
+            total, st->bytes_read, st->bytes_written, st->n_open, st->n_read, st->n_write, st->n_stat,
+            st->blocks_dirtied, st->bits_scanned, ru.ru_maxrss, minflt, majflt);
+        lat_format(buf, sizeof(buf), &n, st->lat, 1);
+        OUT("}\n");
+    } else {
+        OUT("stats: image '%s'\nstats:", image);
+        for(int i=0;i<PH_COUNT;i++) OUT(" %s %.3f ms,", PHASE_NAMES[i], st->phase_ms[i]);
+        OUT(" total %.3f ms\n", total);
+        OUT("stats: read %" PRIu64 " B, written %" PRIu64 " B, calls open=%" PRIu64 " read=%" PRIu64
+            " write=%" PRIu64 " stat=%" PRIu64 "\n", st->bytes_read, st->bytes_written,
+            st->n_open, st->n_read, st->n_write, st->n_stat);
+        OUT("stats: blocks dirtied %" PRIu64 ", bitmap bits scanned %" PRIu64 ", peak RSS %ld KiB\n",
+            st->blocks_dirtied, st->bits_scanned, ru.ru_maxrss);
+        OUT("stats: page faults minor %ld, major %ld\n", minflt, majflt);
+        lat_format(buf, sizeof(buf), &n, st->lat, 0);
+    }
+#undef OUT
+    fputs(buf, stderr);
+}
+
+//  --prom-textfile: image health, template cache and op metrics in the
+//  Prometheus text format, for node_exporter's textfile collector
+
+typedef struct {
+    int      valid;
+    uint64_t inodes, free_inodes;
+    uint64_t data_blocks, free_blocks;
+    uint64_t free_extents, largest_free;   // runs of clear bits in data_bmap
+} health_t;
+
+static atomic_uint_fast64_t tmpl_hits, tmpl_misses;
+
+static void health_scan(const superblock_t* sb, const uint8_t* ibmap, const uint8_t* dbmap, health_t* h){
+    memset(h, 0, sizeof(*h));
+    h->valid = 1;
+    h->inodes = sb->inode_count;
+    h->data_blocks = sb->data_region_blocks;
+    for(uint32_t i=0;i<(uint32_t)sb->inode_count;i++) h->free_inodes += !test_bit(ibmap, i);
+    uint64_t run = 0;
+    for(uint32_t i=0;i<=(uint32_t)sb->data_region_blocks;i++){
+        if(i < sb->data_region_blocks && !test_bit(dbmap, i)){ run++; h->free_blocks++; continue; }
+        if(run){ h->free_extents++; if(run > h->largest_free) h->largest_free = run; }
+        run = 0;
+    }
+}
+
+// Prometheus label values escape backslash, quote and newline
+static void prom_label(FILE* f, const char* v){
+    for(; *v; v++){
+        if(*v=='\\' || *v=='"') fputc('\\', f);
+        if(*v=='\n'){ fputs("\\n", f); continue; }
+        fputc(*v, f);
+    }
+}
+
+static void prom_gauge(FILE* f, const char* name, const char* help, const char* const* images,
+                       const health_t* hs, uint32_t n, size_t off){
+    fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+    for(uint32_t i=0;i<n;i++){
+        if(!hs[i].valid) continue;
+        fprintf(f, "%s{image=\"", name); prom_label(f, images[i]);
+        fprintf(f, "\"} %" PRIu64 "\n", *(const uint64_t*)((const char*)&hs[i] + off));
+    }
+}
+
+// Written to a temp file and renamed, so the collector never reads half a file
+static int prom_write(const char* path, const char* const* images, const health_t* hs, uint32_t n,
+                      const hist_t* lat){
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if(fd < 0){ perror("prom textfile"); return -1; }
+    FILE* f = fdopen(fd, "w");
+    if(!f){ close(fd); unlink(tmp); return -1; }
+
+    prom_gauge(f, "vsfs_inodes", "Inodes in the image.", images, hs, n, offsetof(health_t, inodes));
+    prom_gauge(f, "vsfs_free_inodes", "Free inodes in the image.", images, hs, n, offsetof(health_t, free_inodes));
+    prom_gauge(f, "vsfs_data_blocks", "Blocks in the data region.", images, hs, n, offsetof(health_t, data_blocks));
+    prom_gauge(f, "vsfs_free_blocks", "Free data blocks.", images, hs, n, offsetof(health_t, free_blocks));
+    prom_gauge(f, "vsfs_free_extents", "Runs of free data blocks.", images, hs, n, offsetof(health_t, free_extents));
+    prom_gauge(f, "vsfs_largest_free_extent_blocks", "Longest run of free data blocks.", images, hs, n,
+               offsetof(health_t, largest_free));
+    fprintf(f, "# HELP vsfs_free_space_fragmentation 1 - largest free run / free blocks.\n"
+               "# TYPE vsfs_free_space_fragmentation gauge\n");
+    for(uint32_t i=0;i<n;i++){
+        if(!hs[i].valid) continue;
+        fprintf(f, "vsfs_free_space_fragmentation{image=\""); prom_label(f, images[i]);
+        fprintf(f, "\"} %.6f\n", hs[i].free_blocks ? 1.0 - (double)hs[i].largest_free / (double)hs[i].free_blocks : 0.0);
+    }
+
+    uint64_t hits = atomic_load(&tmpl_hits), misses = atomic_load(&tmpl_misses);
+    fprintf(f, "# HELP vsfs_template_cache_hits_total Images cloned from the template cache.\n"
+               "# TYPE vsfs_template_cache_hits_total counter\nvsfs_template_cache_hits_total %" PRIu64 "\n"
+               "# HELP vsfs_template_cache_misses_total Template cache lookups that had to build.\n"
+               "# TYPE vsfs_template_cache_misses_total counter\nvsfs_template_cache_misses_total %" PRIu64 "\n"
+               "# HELP vsfs_template_cache_hit_ratio Hits / lookups.\n"
+               "# TYPE vsfs_template_cache_hit_ratio gauge\nvsfs_template_cache_hit_ratio %.6f\n",
+               hits, misses, hits + misses ? (double)hits / (double)(hits + misses) : 0.0);
+
+    // cumulative buckets at decade bounds; a log bucket counts under `le` only if
+    // its whole range fits, so counts can lag by the histogram's bucket error
+    static const double LE_S[] = { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1, 10 };
+    fprintf(f, "# HELP vsfs_op_latency_seconds Per-operation latency.\n"
+               "# TYPE vsfs_op_latency_seconds histogram\n");
+    for(int op=0; op<OP_COUNT; op++){
+        const hist_t* h = &lat[op];
+        for(size_t k=0;k<sizeof(LE_S)/sizeof(LE_S[0]);k++){
+            uint64_t le_ns = (uint64_t)(LE_S[k] * 1e9), cum = 0;
+            for(uint32_t i=0;i<HIST_BUCKETS && hist_bucket_max(i) <= le_ns;i++) cum += h->b[i];
+            fprintf(f, "vsfs_op_latency_seconds_bucket{op=\"%s\",le=\"%g\"} %" PRIu64 "\n", OP_NAMES[op], LE_S[k], cum);
+        }
+        fprintf(f, "vsfs_op_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", OP_NAMES[op], h->n);
+        fprintf(f, "vsfs_op_latency_seconds_sum{op=\"%s\"} %.9f\n", OP_NAMES[op], h->sum / 1e9);
+        fprintf(f, "vsfs_op_latency_seconds_count{op=\"%s\"} %" PRIu64 "\n", OP_NAMES[op], h->n);
+    }
+    fprintf(f, "# HELP vsfs_last_update_timestamp_seconds When this file was written.\n"
+               "# TYPE vsfs_last_update_timestamp_seconds gauge\nvsfs_last_update_timestamp_seconds %lld\n",
+               (long long)time(NULL));
+
+    int ok = fflush(f)==0 && fchmod(fileno(f), 0644)==0;
+    if(fclose(f)!=0) ok = 0;
+    if(!ok || rename(tmp, path)!=0){ perror("prom textfile"); unlink(tmp); return -1; }
+    return 0;
+}
+
+//  Trace points (build with -DVSFS_TRACE): each thread appends complete
+//  events to its own ring, so recording takes no lock; --trace dumps all
+//  rings as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev)
+//  after the threads are done. Without VSFS_TRACE the macros compile away.
+
+#ifdef VSFS_TRACE
+#define TRACE_RING 8192u   // events kept per thread; oldest are overwritten
+
+typedef struct { const char* name; double ts_us, dur_us; uint64_t arg; } trace_ev_t;
+
+typedef struct trace_ring {
+    trace_ev_t          ev[TRACE_RING];
+    _Atomic uint64_t    head;     // events ever written; only the owner thread stores
+    uint32_t            tid;
+    struct trace_ring*  next;
+} trace_ring_t;
+
+static _Atomic(trace_ring_t*) trace_rings;
+static atomic_uint            trace_next_tid;
+static _Thread_local trace_ring_t* trace_self;
+
+static double trace_now_us(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// name must be a string literal: it is read again at dump time
+static void trace_emit(const char* name, double t0_us, uint64_t arg){
+    trace_ring_t* r = trace_self;
+    if(!r){
+        r = (trace_ring_t*)calloc(1, sizeof(*r));
+        if(!r) return;
+        r->tid = atomic_fetch_add(&trace_next_tid, 1) + 1;
+        r->next = atomic_load(&trace_rings);
+        while(!atomic_compare_exchange_weak(&trace_rings, &r->next, r)){}
+        trace_self = r;
+    }
+    uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    trace_ev_t* e = &r->ev[h % TRACE_RING];
+    e->name = name; e->ts_us = t0_us; e->arg = arg;
+    e->dur_us = trace_now_us() - t0_us;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+static int trace_dump(const char* path){
+    FILE* f = fopen(path, "w");
+    if(!f){ perror("fopen --trace"); return -1; }
+    fprintf(f, "{\"traceEvents\":[\n");
+    int first = 1;
+    for(trace_ring_t* r = atomic_load(&trace_rings); r; r = r->next){
+        uint64_t h = atomic_load_explicit(&r->head, memory_order_acquire);
+        for(uint64_t i = h > TRACE_RING ? h - TRACE_RING : 0; i < h; i++){
+            const trace_ev_t* e = &r->ev[i % TRACE_RING];
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                       "\"args\":{\"n\":%" PRIu64 "}}", first ? "" : ",\n", e->name, r->tid,
+                       e->ts_us, e->dur_us, e->arg);
+            first = 0;
+        }
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(f)==0 ? 0 : -1;
+}
+
+#define TRACE_BEGIN(t)          double t = trace_now_us()
+#define TRACE_END(t, name, arg) trace_emit(name, t, (uint64_t)(arg))
+#else
+#define TRACE_BEGIN(t)          (void)0
+#define TRACE_END(t, name, arg) (void)0
+#endif
+
+//  --from-dir / --manifest: host files to copy into / at mkfs time
+
+typedef struct {
+    char*    path;        // host path (owned)
+    char     name[58];    // on-disk name, truncated like mkfs_adder does
+    size_t   namelen;
+    uint64_t size;
+    uint32_t blocks;
+} src_file_t;
+
+typedef struct src_set {
+    src_file_t* files;
+    uint32_t    count, cap;
+    uint64_t    data_blocks;  // sum of file blocks, pointer blocks included
+    int         indirect;     // accept files past 12 blocks
+} src_set_t;
+
+// With SB_FLAG_INDIRECT a regular file maps blocks 12.. through reserved_0
+// (single indirect: 1024 block numbers) and then reserved_1 (double
+// indirect: 1024 single-indirect blocks). Pointer blocks needed for nb blocks:
+static uint32_t map_blocks(uint32_t nb){
+    if(nb <= DIRECT_MAX) return 0;
+    nb -= DIRECT_MAX;
+    if(nb <= PTRS_PER_BLK) return 1;
+    nb -= PTRS_PER_BLK;
+    return 2 + (nb + PTRS_PER_BLK - 1) / PTRS_PER_BLK;
+}
+
+// Fills in a file's block map. blks holds its nb data blocks in file order,
+// then map_blocks(nb) pointer blocks: the single indirect, the second-level
+// blocks of the double indirect, and last the double indirect itself.
+static void map_file(uint8_t* img, inode_t* ino, const uint32_t* blks, uint32_t nb){
+    uint32_t i = 0;
+    for(; i<nb && i<DIRECT_MAX; i++) ino->direct[i] = blks[i];
+    if(i == nb) return;
+    const uint32_t* p = blks + nb;
+    uint32_t* single = (uint32_t*)(img + BS * (uint64_t)p[0]);
+    memset(single, 0, BS);
+    ino->reserved_0 = *p++;
+    for(uint32_t k=0; k<PTRS_PER_BLK && i<nb; k++) single[k] = blks[i++];
+    if(i == nb) return;
+    uint32_t n2 = (nb - i + PTRS_PER_BLK - 1) / PTRS_PER_BLK;
+    uint32_t* dbl = (uint32_t*)(img + BS * (uint64_t)p[n2]);
+    memset(dbl, 0, BS);
+    ino->reserved_1 = p[n2];
+    for(uint32_t j=0; j<n2; j++){
+        uint32_t* l2 = (uint32_t*)(img + BS * (uint64_t)p[j]);
+        memset(l2, 0, BS);
+        dbl[j] = p[j];
+        for(uint32_t k=0; k<PTRS_PER_BLK && i<nb; k++) l2[k] = blks[i++];
+    }
+}
+
+static void src_set_free(src_set_t* s){
+    for(uint32_t i=0;i<s->count;i++) free(s->files[i].path);
+    free(s->files);
+    memset(s, 0, sizeof(*s));
+}
+
+static const char* base_name(const char* path){
+    const char* s = strrchr(path, '/');
+#ifdef _WIN32
+    const char* b = strrchr(path, '\\');
+    if(!s || (b && b > s)) s = b;
+#endif
+    return s ? s+1 : path;
+}
+
+// Takes ownership of path. Returns 1 if skipped, 0 if added, -1 on error.
+static int add_src_file(src_set_t* s, char* path, const char* name, stats_t* stats){
+    struct stat st;
+    stats->n_stat++;
+    if(stat(path,&st)!=0){ perror(path); free(path); return -1; }
+    if(!S_ISREG(st.st_mode)){
+        fprintf(stderr,"Skipping '%s' (not a regular file)\n", path);
+        free(path); return 1;
+    }
+    uint64_t fsize = (uint64_t)st.st_size;
+    uint32_t nb = (uint32_t)((fsize + BS - 1) / BS);
+    if(!s->indirect && nb > DIRECT_MAX){
+        fprintf(stderr,"'%s' too large for 12 direct blocks (max 49152 bytes, see --indirect)\n", path);
+        free(path); return -1;
+    }
+    if(fsize > (uint64_t)MAP_MAX_BLOCKS * BS){
+        fprintf(stderr,"'%s' too large for the block map\n", path);
+        free(path); return -1;
+    }
+    if(s->count == s->cap){
+        uint32_t ncap = s->cap ? s->cap*2 : 64;
+        src_file_t* nf = (src_file_t*)realloc(s->files, sizeof(src_file_t)*ncap);
+        if(!nf){ free(path); return -1; }
+        s->files = nf; s->cap = ncap;
+    }
+    src_file_t* f = &s->files[s->count];
+    memset(f, 0, sizeof(*f));
+    f->path = path;
+    f->namelen = strlen(name);
+    if(f->namelen > sizeof(f->name)) f->namelen = sizeof(f->name);
+    memcpy(f->name, name, f->namelen);
+    f->size = fsize;
+    f->blocks = nb;
+    for(uint32_t j=0;j<s->count;j++){
+        if(!memcmp(s->files[j].name, f->name, sizeof(f->name))){
+            fprintf(stderr,"'%s' and '%s' map to the same 58-byte name\n",
+                    s->files[j].path, path);
+            free(path); return -1;
+        }
+    }
+    s->count++;
+    s->data_blocks += nb + map_blocks(nb);
+    return 0;
+}
+
+static int scan_dir(const char* dir, src_set_t* s, stats_t* stats){
+    stats->n_open++;
+    DIR* d = opendir(dir);
+    if(!d){ perror("opendir --from-dir"); return -1; }
+    struct dirent* e;
+    while((e = readdir(d))){
+        if(!strcmp(e->d_name,".") || !strcmp(e->d_name,"..")) continue;
+        size_t plen = strlen(dir) + 1 + strlen(e->d_name) + 1;
+        char* path = (char*)malloc(plen);
+        if(!path){ closedir(d); return -1; }
+        snprintf(path, plen, "%s/%s", dir, e->d_name);
+        if(add_src_file(s, path, e->d_name, stats) < 0){ closedir(d); return -1; }
+    }
+    closedir(d);
+    return 0;
+}
+
+// Manifest: one host path per line, blank lines and '#' comments ignored
+static int scan_manifest(const char* manifest, src_set_t* s, stats_t* stats){
+    stats->n_open++;
+    FILE* m = fopen(manifest, "r");
+    if(!m){ perror("fopen --manifest"); return -1; }
+    char line[4096];
+    while(fgets(line, sizeof(line), m)){
+        size_t n = strcspn(line, "\r\n");
+        line[n] = 0;
+        if(!n || line[0]=='#') continue;
+        char* path = strdup(line);
+        if(!path){ fclose(m); return -1; }
+        if(add_src_file(s, path, base_name(line), stats) < 0){ fclose(m); return -1; }
+    }
+    fclose(m);
+    return 0;
+}
+
+// --order name. Files are placed in src order, dirent i and data run i
+// alike, so sorting here makes a name-order directory read one sweep.
+static int by_name(const void* a, const void* b){
+    const src_file_t* x = (const src_file_t*)a; const src_file_t* y = (const src_file_t*)b;
+    return memcmp(x->name, y->name, sizeof(x->name));   // zero-padded, so this is strcmp order
+}
+
+// Root dir blocks needed for '.', '..' and one dirent per file
+static uint32_t root_dir_blocks(uint32_t nfiles){
+    const uint32_t per_blk = BS / sizeof(dirent64_t);
+    return (2 + nfiles + per_blk - 1) / per_blk;
+}
+
+// Fills in size_kib / inodes left at 0 and checks the given ones are big enough
+static int plan_geometry(cli_t* c, const src_set_t* s){
+    const uint64_t inodes_per_blk = BS / INODE_SIZE;
+    uint32_t dir_blks = root_dir_blocks(s->count);
+    if(dir_blks > DIRECT_MAX){
+        fprintf(stderr,"Too many files for the root directory (%u)\n", s->count); return -1;
+    }
+    uint32_t need_inodes = s->count + 1;
+    if(!c->inodes) c->inodes = need_inodes < 128 ? 128 : need_inodes;
+    if(c->inodes > 512 || need_inodes > c->inodes){
+        fprintf(stderr,"%u files need %u inodes (max %u)\n", s->count, need_inodes,
+                c->inodes > 512 ? 512u : c->inodes);
+        return -1;
+    }
+    uint64_t itbl = (c->inodes + inodes_per_blk - 1) / inodes_per_blk;
+    uint64_t need_blocks = 3 + itbl + dir_blks + s->data_blocks;
+    uint64_t need_kib = need_blocks * (BS / 1024u);
+    if(!c->size_kib) c->size_kib = need_kib < 180 ? 180 : (uint32_t)need_kib;
+    if(c->size_kib > 4096 || need_kib > c->size_kib){
+        fprintf(stderr,"Files need %" PRIu64 " KiB (max %u)\n", need_kib,
+                c->size_kib > 4096 ? 4096u : c->size_kib);
+        return -1;
+    }
+    return 0;
+}
+
+static void fill_superblock(superblock_t* sb, uint64_t total_blocks, uint32_t inodes,
+                            uint64_t inode_tbl_blks, uint32_t flags){
+    memset(sb, 0, sizeof(*sb));
+    sb->magic = 0x4D565346u; // 'MVSF'
+    sb->version = 1;
+    sb->block_size = BS;
+    sb->total_blocks = total_blocks;
+    sb->inode_count  = inodes;
+
+    sb->inode_bitmap_start = 1;
+    sb->inode_bitmap_blocks = 1;
+    sb->data_bitmap_start = 2;
+    sb->data_bitmap_blocks = 1;
+    sb->inode_table_start = 3;
+    sb->inode_table_blocks = inode_tbl_blks;
+    sb->data_region_start = 3 + inode_tbl_blks;
+    sb->data_region_blocks = total_blocks - sb->data_region_start;
+
+    sb->root_inode = ROOT_INO;
+    sb->mtime_epoch = (uint64_t)time(NULL);
+    sb->flags = flags;
+    superblock_crc_finalize(sb);
+}
+
+//  --template-cache: empty images keyed by (size, inodes, flags)
+
+static void template_path(char* out, size_t n, const char* dir, const superblock_t* sb){
+    snprintf(out, n, "%s/mvsfs-%" PRIu64 "k-%" PRIu64 "i-f%08x.img",
+             dir, sb->total_blocks * (BS/1024u), sb->inode_count, sb->flags);
+}
+
+// Copies src into dst: FICLONE (reflink) first, then copy_file_range, then plain read/write
+static int clone_fd(int src, int dst, uint64_t bytes){
+#ifdef __linux__
+    if(ioctl(dst, FICLONE, src)==0) return 0;
+    loff_t in_off = 0, out_off = 0;
+    uint64_t left = bytes;
+    while(left){
+        ssize_t n = copy_file_range(src, &in_off, dst, &out_off, (size_t)left, 0);
+        if(n <= 0) break;
+        left -= (uint64_t)n;
+    }
+    if(!left) return 0;
+    if(ftruncate(dst, 0)!=0) return -1;
+#endif
+    uint8_t buf[16*BS];
+    uint64_t off = 0;
+    while(off < bytes){
+        ssize_t n = pread(src, buf, sizeof(buf), (off_t)off);
+        if(n <= 0) return -1;
+        if(pwrite(dst, buf, (size_t)n, (off_t)off) != n) return -1;
+        off += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Cache hit: clone the template to out and patch the superblock mtime + CRC.
+// Returns 0 on hit, 1 on miss, -1 on error writing out.
+static int template_clone(const char* tpath, const char* out, const superblock_t* want){
+    // --image naming the template itself would be truncated before it is read
+    char rt[PATH_MAX], ro[PATH_MAX];
+    if(realpath(tpath, rt) && realpath(out, ro) && !strcmp(rt, ro)){
+        fprintf(stderr,"--image '%s' is the cached template itself\n", out); return -1;
+    }
+    int src = open(tpath, O_RDONLY);
+    if(src < 0) return 1;
+    superblock_t sb;
+    struct stat st;
+    uint8_t* head = (uint8_t*)malloc(3 * BS);    // superblock and both bitmaps
+    if(!head){ close(src); return 1; }
+    int ok = pread(src, head, 3 * BS, 0) == (ssize_t)(3 * BS) && fstat(src, &st)==0;
+    memcpy(&sb, head, sizeof(sb));
+    if(ok){
+        // seal check on the block as stored, then the bitmaps of an empty image:
+        // only inode #1 and the root dir block in use
+        uint32_t stored = sb.checksum;
+        memset(head + offsetof(superblock_t, checksum), 0, 4);
+        ok = crc32(head, BS - 4) == stored;
+        for(uint32_t i=0; i<2*BS && ok; i++) ok = head[BS + i] == (i % BS ? 0 : 1);
+    }
+    free(head);
+    if(!ok || (uint64_t)st.st_size != want->total_blocks * BS ||
+       sb.magic != want->magic || sb.total_blocks != want->total_blocks ||
+       sb.inode_count != want->inode_count || sb.flags != want->flags){
+        fprintf(stderr,"Ignoring stale template '%s'\n", tpath);
+        close(src); return 1;
+    }
+    int dst = open(out, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(dst < 0){ perror("open"); close(src); return -1; }
+    int rc = clone_fd(src, dst, (uint64_t)st.st_size);
+    close(src);
+    if(rc==0){
+        sb.mtime_epoch = want->mtime_epoch;
+        superblock_crc_finalize(&sb);
+        if(pwrite(dst, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb)) rc = -1;
+    }
+    if(close(dst)!=0) rc = -1;
+    if(rc!=0) fprintf(stderr,"Failed to clone template into '%s'\n", out);
+    return rc;
+}
+
+// Cache miss: publish a freshly built empty image (tmp + fsync + rename, so
+// concurrent builders never see a partial template)
+static void template_store(const char* tpath, const uint8_t* img, uint64_t total_blocks, hist_t* fsync_lat){
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", tpath);
+    int fd = mkstemp(tmp);
+    if(fd < 0){ perror("open template"); return; }
+    size_t bytes = (size_t)(total_blocks * BS);
+    int ok = fchmod(fd, 0644)==0 && write(fd, img, bytes) == (ssize_t)bytes;
+    TRACE_BEGIN(tf);
+    double t0 = now_ns();
+    ok = ok && fsync(fd)==0;
+    hist_record(fsync_lat, (uint64_t)(now_ns() - t0));
+    TRACE_END(tf, "fsync", bytes);
+    if(close(fd)!=0) ok = 0;
+    if(!ok || rename(tmp, tpath)!=0){ perror("store template"); unlink(tmp); }
+}
+
+//  --stripes: the data region is spread over N files in stripe_blocks units,
+//  round-robin; file 0 (the image path) holds a header block and all metadata,
+//  files 1..N-1 are <image>.1 ... Each file is written by its own thread.
+
+#define STRIPE_MAGIC   0x5353564Du   // "MVSS"
+#define STRIPE_VERSION 1u
+#define STRIPE_MAX     16u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t stripes;
+    uint32_t stripe_blocks;
+    uint64_t total_blocks;
+    uint64_t meta_blocks;     // blocks before the data region, all in file 0
+    uint32_t header_crc;      // over everything above
+} stripe_hdr_t;
+#pragma pack(pop)
+
+typedef struct {
+    const char*         path;
+    const uint8_t*      img;
+    const stripe_hdr_t* h;
+    uint32_t            file;
+    uint64_t            wrote;   // blocks
+    int                 err;
+} stripe_job_t;
+
+static int pwrite_full(int fd, const void* buf, size_t n, uint64_t off){
+    const uint8_t* p = (const uint8_t*)buf;
+    while(n){
+        ssize_t w = pwrite(fd, p, n, (off_t)off);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) return -1;
+        p += w; n -= (size_t)w; off += (uint64_t)w;
+    }
+    return 0;
+}
+
+static void* stripe_worker(void* arg){
+    stripe_job_t* j = (stripe_job_t*)arg;
+    const stripe_hdr_t* h = j->h;
+    int fd = open(j->path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(fd < 0){ perror(j->path); j->err = 1; return NULL; }
+    uint64_t off = 0;
+    if(j->file == 0){
+        uint8_t hb[BS]; memset(hb, 0, sizeof(hb));
+        memcpy(hb, h, sizeof(*h));
+        if(pwrite_full(fd, hb, BS, 0) != 0 || pwrite_full(fd, j->img, (size_t)(h->meta_blocks * BS), BS) != 0) j->err = 1;
+        else j->wrote += h->meta_blocks;
+        off = (1 + h->meta_blocks) * BS;
+    }
+    // unit u of the data region lands in file u % stripes, row u / stripes
+    uint64_t data = h->total_blocks - h->meta_blocks;
+    for(uint64_t u = j->file; !j->err && u * h->stripe_blocks < data; u += h->stripes){
+        uint64_t first = u * h->stripe_blocks;
+        uint64_t n = data - first < h->stripe_blocks ? data - first : h->stripe_blocks;
+        if(pwrite_full(fd, j->img + (h->meta_blocks + first) * BS, (size_t)(n * BS), off) != 0){ j->err = 1; break; }
+        off += n * BS;
+        j->wrote += n;
+    }
+    if(j->err) perror(j->path);
+    if(close(fd) != 0 && !j->err){ perror(j->path); j->err = 1; }
+    return NULL;
+}
+
+// Returns the number of blocks written across all files (total_blocks on success)
+static uint64_t stripe_write(const char* image, const uint8_t* img, uint64_t total_blocks, uint64_t meta_blocks,
+                             uint32_t stripes, uint32_t stripe_blocks){
+    stripe_hdr_t h = { STRIPE_MAGIC, STRIPE_VERSION, BS, stripes, stripe_blocks, total_blocks, meta_blocks, 0 };
+    h.header_crc = crc32(&h, offsetof(stripe_hdr_t, header_crc));
+    char paths[STRIPE_MAX][4096];
+    stripe_job_t jobs[STRIPE_MAX];
+    pthread_t th[STRIPE_MAX];
+    int started[STRIPE_MAX] = {0};
+    for(uint32_t f=0; f<stripes; f++){
+        if(f == 0) snprintf(paths[f], sizeof(paths[f]), "%s", image);
+        else snprintf(paths[f], sizeof(paths[f]), "%s.%u", image, f);
+        jobs[f] = (stripe_job_t){ paths[f], img, &h, f, 0, 0 };
+        started[f] = pthread_create(&th[f], NULL, stripe_worker, &jobs[f]) == 0;
+        if(!started[f]) stripe_worker(&jobs[f]);
+    }
+    uint64_t wrote = 0;
+    for(uint32_t f=0; f<stripes; f++){
+        if(started[f]) pthread_join(th[f], NULL);
+        wrote += jobs[f].wrote;
+    }
+    return wrote;
+}
+
+//  Image buffer. --memfd[=huge]: built in an anonymous memfd (tmpfs pages,
+//  or hugetlbfs with =huge) instead of the heap, reaching disk only in the
+//  final write (or the stripe writers). --thp / --populate cut the 4 KiB
+//  first-touch faults of filling it; --stats counts them.
+
+// Zero-filled; *map_len is the mapping size, 0 if the buffer came from the heap.
+// thp: an anonymous 2 MiB-aligned mapping with MADV_HUGEPAGE instead of calloc.
+static uint8_t* img_alloc(size_t bytes, int memfd, int thp, size_t* map_len){
+    *map_len = 0;
+#ifdef __linux__
+    const size_t HP = 2u << 20;
+    for(int huge = memfd == 2; memfd && huge >= 0; huge--){
+        size_t len = huge ? (bytes + HP - 1) & ~(HP - 1) : bytes;
+        int fd = memfd_create("mvsfs-image", MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0));
+        if(fd >= 0 && ftruncate(fd, (off_t)len)==0){
+            void* p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if(p != MAP_FAILED){
+                if(thp && !huge) madvise(p, len, MADV_HUGEPAGE);   // shmem THP, if enabled for tmpfs
+                *map_len = len; return (uint8_t*)p;
+            }
+        } else if(fd >= 0) close(fd);
+        fprintf(stderr,"memfd%s: %s, %s\n", huge ? " (hugetlb)" : "", strerror(errno),
+                huge ? "using normal pages" : "using the heap");
+    }
+    if(thp){
+        size_t len = (bytes + HP - 1) & ~(HP - 1);
+        uint8_t* raw = (uint8_t*)mmap(NULL, len + HP, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(raw != MAP_FAILED){
+            // trim to a 2 MiB boundary so whole huge pages fit
+            uint8_t* p = (uint8_t*)(((uintptr_t)raw + HP - 1) & ~(uintptr_t)(HP - 1));
+            if(p > raw) munmap(raw, (size_t)(p - raw));
+            if(raw + len + HP > p + len) munmap(p + len, (size_t)(raw + len + HP - (p + len)));
+            if(madvise(p, len, MADV_HUGEPAGE) != 0) perror("madvise(MADV_HUGEPAGE)");
+            *map_len = len; return p;
+        }
+        perror("mmap --thp");
+    }
+#else
+    if(memfd || thp) fprintf(stderr,"--memfd/--thp need Linux, using the heap\n");
+#endif
+    return (uint8_t*)calloc(1, bytes);
+}
+static void img_free(uint8_t* p, size_t map_len){
+#ifdef __linux__
+    if(map_len){ munmap(p, map_len); return; }
+#endif
+    free(p);
+}
+
+// --populate: fault in [off, off+len) of the buffer now (the metadata blocks),
+// so the build or add itself doesn't stop on first-touch faults
+static void img_prefault(uint8_t* img, size_t off, size_t len){
+    long pg = sysconf(_SC_PAGESIZE);
+    uint8_t* a = (uint8_t*)((uintptr_t)(img + off) & ~(uintptr_t)(pg - 1));
+    len += (size_t)(img + off - a);
+#if defined(__linux__) && defined(MADV_POPULATE_WRITE)
+    if(madvise(a, len, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    // write-touch each page; a no-op store still forces the page (or its COW copy) in
+    for(size_t o=0; o<len; o+=(size_t)pg){ volatile uint8_t* q = a + o; *q = *q; }
+}
+
+//  --batch: image I/O gate, shared by all build threads (no-op when limit is 0)
+
+static struct {
+    pthread_mutex_t mu;
+    pthread_cond_t  cv;
+    uint32_t        limit, active;
+} io_gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+static void io_acquire(void){
+    if(!io_gate.limit) return;
+    TRACE_BEGIN(tw);
+    pthread_mutex_lock(&io_gate.mu);
+    while(io_gate.active >= io_gate.limit) pthread_cond_wait(&io_gate.cv, &io_gate.mu);
+    io_gate.active++;
+    pthread_mutex_unlock(&io_gate.mu);
+    TRACE_END(tw, "lock_wait", io_gate.limit);
+}
+static void io_release(void){
+    if(!io_gate.limit) return;
+    pthread_mutex_lock(&io_gate.mu);
+    io_gate.active--;
+    pthread_cond_signal(&io_gate.cv);
+    pthread_mutex_unlock(&io_gate.mu);
+}
+
+// health, when given, receives the built image's free-space figures
+static int build_image(cli_t cli, health_t* health){
+    stats_t st; memset(&st, 0, sizeof(st));
+    st.phase = PH_LOAD; st.phase_t0 = now_ms();
+    thread_faults(&st.minflt0, &st.majflt0);
+
+    src_set_t src; memset(&src, 0, sizeof(src));
+    src.indirect = cli.indirect;
+    if(cli.from_dir || cli.manifest){
+        int rc = 0;
+        if(cli.shard_src){ src = *cli.shard_src; free(cli.shard_src); }
+        else rc = cli.from_dir ? scan_dir(cli.from_dir, &src, &st) : scan_manifest(cli.manifest, &src, &st);
+        if(rc!=0){ src_set_free(&src); return 4; }
+        if(cli.order_name) qsort(src.files, src.count, sizeof(*src.files), by_name);
+        stats_phase(&st, PH_VALIDATE);
+        if(plan_geometry(&cli, &src)!=0){ src_set_free(&src); return 3; }
+    }
+    stats_phase(&st, PH_VALIDATE);
+    if(cli.plan){
+        // exact arguments for the smallest image holding this file set
+        fprintf(stderr,"%u files, %" PRIu64 " data blocks, %u root dir blocks\n",
+                src.count, src.data_blocks, root_dir_blocks(src.count));
+        fprintf(stdout,"--size-kib %u --inodes %u%s\n", cli.size_kib, cli.inodes, cli.indirect ? " --indirect" : "");
+        src_set_free(&src);
+        return 0;
+    }
+    const uint32_t dir_blks = root_dir_blocks(src.count);
 
     const uint64_t total_blocks = ((uint64_t)cli.size_kib * 1024u) / BS;
     const uint64_t inodes_per_blk = BS / INODE_SIZE;
@@ -152,12 +1105,52 @@ int main(int argc, char** argv){
     if(total_blocks < 3 + inode_tbl_blks + 1){
         fprintf(stderr,"Image too small: %u inodes need %" PRIu64 " blocks\n",
                 cli.inodes, inode_tbl_blks);
-        return 3;
+        src_set_free(&src); return 3;
+    }
+
+    // Empty images come straight from the template cache when possible
+    char tpath[4096] = "";
+    if(cli.tmpl_dir && !cli.from_dir && !cli.manifest && !cli.stripes){
+        superblock_t want;
+        fill_superblock(&want, total_blocks, cli.inodes, inode_tbl_blks, cli.indirect ? SB_FLAG_INDIRECT : 0);
+        template_path(tpath, sizeof(tpath), cli.tmpl_dir, &want);
+        stats_phase(&st, PH_WRITE);
+        io_acquire();
+        TRACE_BEGIN(tc);
+        double t0 = now_ns();
+        int rc = template_clone(tpath, cli.image, &want);
+        // a failed clone is neither a hit nor a miss: the build stops here
+        if(rc >= 0){
+            hist_record(&st.lat[rc == 0 ? OP_COMMIT : OP_LOOKUP], (uint64_t)(now_ns() - t0));
+            atomic_fetch_add(rc == 0 ? &tmpl_hits : &tmpl_misses, 1);
+        }
+        TRACE_END(tc, rc == 0 ? "commit" : rc > 0 ? "cache_miss" : "clone_error", total_blocks);
+        io_release();
+        if(rc < 0) return 5;
+        if(rc == 0){
+            st.n_open += 2; st.n_read++; st.n_write += 2;
+            st.bytes_written += total_blocks * BS;
+            st.blocks_dirtied += total_blocks;
+            fprintf(stdout,"Created MiniVSFS image '%s' (%" PRIu64 " blocks, %u inodes, from template)\n",
+                    cli.image, total_blocks, cli.inodes);
+            batch_lat_merge(&st);
+            if(cli.stats) stats_print(&st, cli.stats == 2, cli.image);
+            // clean template: everything but the root inode and root dir block is free
+            health_t h = { 1, cli.inodes, cli.inodes - 1, want.data_region_blocks, want.data_region_blocks - 1,
+                           want.data_region_blocks > 1, want.data_region_blocks - 1 };
+            if(health) *health = h;
+            if(cli.prom) prom_write(cli.prom, (const char* const*)&cli.image, &h, 1, st.lat);
+            return 0;
+        }
     }
 
     // Allocating a full img in mem
-    uint8_t* img = (uint8_t*)calloc((size_t)total_blocks, BS);
-    if(!img){ perror("calloc"); return 1; }
+    stats_phase(&st, PH_ALLOC);
+    TRACE_BEGIN(ta);
+    size_t map_len;
+    uint8_t* img = img_alloc((size_t)total_blocks * BS, cli.memfd, cli.thp, &map_len);
+    if(!img){ perror("alloc image"); src_set_free(&src); return 1; }
+    if(cli.populate) img_prefault(img, 0, (size_t)(3 + inode_tbl_blks + dir_blks) * BS);
 
     // Pointers to blocks
     uint8_t* blk0 = img + BS*0;  // superblock!
@@ -168,30 +1161,13 @@ int main(int argc, char** argv){
     
     uint64_t inode_table_start = 3;
     uint64_t data_region_start  = 3 + inode_tbl_blks;
-    uint64_t data_region_blocks = total_blocks - data_region_start;
 
     // - superblock things -
     
-    superblock_t sb; memset(&sb, 0, sizeof(sb));
-    sb.magic = 0x4D565346u; // 'MVSF'
-    sb.version = 1;
-    sb.block_size = BS;
-    sb.total_blocks = total_blocks;
-    sb.inode_count  = cli.inodes;
-
-    sb.inode_bitmap_start = 1;
-    sb.inode_bitmap_blocks = 1;
-    sb.data_bitmap_start = 2;
-    sb.data_bitmap_blocks = 1;
-    sb.inode_table_start = inode_table_start;
-    sb.inode_table_blocks = inode_tbl_blks;
-    sb.data_region_start = data_region_start;
-    sb.data_region_blocks = data_region_blocks;
-
-    sb.root_inode = ROOT_INO;
-    sb.mtime_epoch = (uint64_t)time(NULL);
-    sb.flags = 0;
-    superblock_crc_finalize(&sb);
+    superblock_t sb;
+    int prev = stats_phase(&st, PH_CRC);
+    fill_superblock(&sb, total_blocks, cli.inodes, inode_tbl_blks, cli.indirect ? SB_FLAG_INDIRECT : 0);
+    stats_phase(&st, prev);
     memset(blk0, 0, BS);
     memcpy(blk0, &sb, sizeof(sb));
 
@@ -202,8 +1178,8 @@ int main(int argc, char** argv){
     // inode #1 used,
     set_bit(blk1, 0);
     
-    // data region block #0 used, etai root dir
-    set_bit(blk2, 0);
+    // data region block #0 used, etai root dir (more blocks if --from-dir needs them)
+    for(uint32_t i=0;i<dir_blks;i++) set_bit(blk2, i);
 
     
     // - inode table things-
@@ -212,15 +1188,18 @@ int main(int argc, char** argv){
 
     inode_t root; memset(&root, 0, sizeof(root));
     root.mode  = 0040000;                // direc
-    root.links = 2;                    // '.' and '..' curr and par
+    root.links = 2 + src.count;        // '.' and '..' curr and par, +1 per file like mkfs_adder
     root.uid = 0; root.gid = 0;
     root.atime = root.mtime = root.ctime = (uint64_t)time(NULL);
-    root.size_bytes = 2 * sizeof(dirent64_t);
-    root.direct[0] = (uint32_t)(data_region_start + 0);
+    root.size_bytes = (2 + src.count) * sizeof(dirent64_t);
+    for(uint32_t i=0;i<dir_blks;i++) root.direct[i] = (uint32_t)(data_region_start + i);
+    prev = stats_phase(&st, PH_CRC);
     inode_crc_finalize(&root);
+    stats_phase(&st, prev);
     itbl[0] = root;               // index 0 == inode #1
 
     // - root directory data thingss-
+    stats_phase(&st, PH_DIRENT);
     
     uint8_t* rootblk = img + BS * root.direct[0];
     memset(rootblk, 0, BS);
@@ -242,17 +1221,386 @@ int main(int argc, char** argv){
     dirent_checksum_finalize(&de);
     memcpy(rootblk + 1*sizeof(dirent64_t), &de, sizeof(de));
 
+    TRACE_END(ta, "allocate", total_blocks);
+
+    // - --from-dir files: inode #2.., data packed contiguously after the root dir blocks
+    uint64_t next_blk = data_region_start + dir_blks;
+    for(uint32_t i=0;i<src.count;i++){
+        const src_file_t* sf = &src.files[i];
+        stats_phase(&st, PH_ALLOC);
+        double t_add = now_ns();
+        uint32_t ino_idx = i + 1;
+        set_bit(blk1, ino_idx);
+
+        inode_t fi; memset(&fi, 0, sizeof(fi));
+        fi.mode  = 0100000; // regular file
+        fi.links = 1;
+        fi.size_bytes = sf->size;
+        fi.atime = fi.mtime = fi.ctime = root.mtime;
+        // data run, then its pointer blocks (if any)
+        const uint32_t run = sf->blocks + map_blocks(sf->blocks);
+        for(uint32_t b=0;b<run;b++) set_bit(blk2, (uint32_t)(next_blk + b - data_region_start));
+        if(run > sf->blocks){
+            uint32_t* blks = (uint32_t*)malloc(sizeof(uint32_t) * run);
+            if(!blks){ img_free(img, map_len); src_set_free(&src); return 1; }
+            for(uint32_t b=0;b<run;b++) blks[b] = (uint32_t)(next_blk + b);
+            map_file(img, &fi, blks, sf->blocks);
+            free(blks);
+        } else {
+            for(uint32_t b=0;b<sf->blocks;b++) fi.direct[b] = (uint32_t)(next_blk + b);
+        }
+        if(sf->blocks){
+            stats_phase(&st, PH_COPY);
+            io_acquire();
+            TRACE_BEGIN(tcp);
+            st.n_open++; st.n_read++;
+            double t_rd = now_ns();
+            FILE* ff = fopen(sf->path, "rb");
+            if(!ff){ perror(sf->path); io_release(); img_free(img, map_len); src_set_free(&src); return 4; }
+            size_t got = fread(img + BS*next_blk, 1, (size_t)sf->size, ff);
+            fclose(ff);
+            hist_record(&st.lat[OP_READ], (uint64_t)(now_ns() - t_rd));
+            TRACE_END(tcp, "copy", got);
+            io_release();
+            if(got != (size_t)sf->size){
+                fprintf(stderr,"Short read on '%s' (changed while building?)\n", sf->path);
+                img_free(img, map_len); src_set_free(&src); return 4;
+            }
+            st.bytes_read += got;
+        }
+        next_blk += run;
+        stats_phase(&st, PH_CRC);
+        inode_crc_finalize(&fi);
+        itbl[ino_idx] = fi;
+
+        // dirent slot 2+i of the root dir, spilling into its later blocks
+        stats_phase(&st, PH_DIRENT);
+        uint32_t slot = 2 + i;
+        uint8_t* dblk = img + BS * root.direct[slot / (BS/sizeof(dirent64_t))];
+        memset(&de, 0, sizeof(de));
+        de.inode_no = ino_idx + 1; de.type = 1;
+        memcpy(de.name, sf->name, sf->namelen);
+        dirent_checksum_finalize(&de);
+        memcpy(dblk + (slot % (BS/sizeof(dirent64_t)))*sizeof(dirent64_t), &de, sizeof(de));
+        hist_record(&st.lat[OP_ADD], (uint64_t)(now_ns() - t_add));
+    }
+
     // - write image
-    FILE* f = fopen(cli.image, "wb");
-    if(!f){ perror("fopen"); free(img); return 5; }
-    size_t wrote = fwrite(img, BS, (size_t)total_blocks, f);
-    fclose(f);
-    free(img);
+    stats_phase(&st, PH_WRITE);
+    io_acquire();
+    TRACE_BEGIN(tw);
+    double t_commit = now_ns();
+    size_t wrote;
+    if(cli.stripes){
+        st.n_open += cli.stripes; st.n_write += cli.stripes;
+        wrote = (size_t)stripe_write(cli.image, img, total_blocks, data_region_start, cli.stripes, cli.stripe_kib / 4);
+        st.bytes_written += BS;   // stripe header block
+    } else {
+        st.n_open++; st.n_write++;
+        FILE* f = fopen(cli.image, "wb");
+        if(!f){ perror("fopen"); io_release(); img_free(img, map_len); src_set_free(&src); return 5; }
+        wrote = fwrite(img, BS, (size_t)total_blocks, f);
+        fclose(f);
+    }
+    hist_record(&st.lat[OP_COMMIT], (uint64_t)(now_ns() - t_commit));
+    TRACE_END(tw, "commit", wrote);
+    st.bytes_written += (uint64_t)wrote * BS;
+    st.blocks_dirtied += 3 + inode_tbl_blks + dir_blks + src.data_blocks;
+    if(wrote == (size_t)total_blocks && tpath[0]) template_store(tpath, img, total_blocks, &st.lat[OP_FSYNC]);
+    io_release();
+    health_t h;
+    health_scan(&sb, blk1, blk2, &h);
+    img_free(img, map_len);
     if(wrote != (size_t)total_blocks){
         fprintf(stderr,"Short write: wrote %zu blocks\n", wrote);
-        return 6;
+        src_set_free(&src); return 6;
+    }
+    // one stdio call so --batch threads don't interleave mid-line
+    if(cli.from_dir || cli.manifest)
+        fprintf(stdout,"Created MiniVSFS image '%s' (%" PRIu64 " blocks, %u inodes, %u files from '%s')\n",
+                cli.image, total_blocks, cli.inodes, src.count, cli.from_dir ? cli.from_dir : cli.manifest);
+    else
+        fprintf(stdout,"Created MiniVSFS image '%s' (%" PRIu64 " blocks, %u inodes)\n",
+                cli.image, total_blocks, cli.inodes);
+    batch_lat_merge(&st);
+    if(cli.stats) stats_print(&st, cli.stats == 2, cli.image);
+    if(health) *health = h;
+    if(cli.prom) prom_write(cli.prom, (const char* const*)&cli.image, &h, 1, st.lat);
+    src_set_free(&src);
+    return 0;
+}
+
+//  --batch: N images from a job file on a pool of build threads
+
+typedef struct {
+    char*  line;        // owned copy of the job line; argv points into it
+    char*  argv[64];
+    int    argc;
+    const char* image;
+    int    rc;
+    double ms;
+    health_t health;    // valid once the job built its image
+} job_t;
+
+typedef struct {
+    job_t*          jobs;
+    uint32_t        count, next;
+    pthread_mutex_t mu;
+    const char*     prom;      // batch-level --prom-textfile, refreshed after every job
+    const char**    images;    // scratch for prom_write, guarded by mu
+    health_t*       healths;
+} job_queue_t;
+
+// Splits on blanks in place; no quoting, so paths with spaces need a manifest
+static int split_args(char* line, char** argv, int max){
+    int n = 0;
+    argv[n++] = "mkfs_builder";
+    for(char* p = line; *p; ){
+        while(*p==' ' || *p=='\t') *p++ = 0;
+        if(!*p) break;
+        if(n == max) return -1;
+        argv[n++] = p;
+        while(*p && *p!=' ' && *p!='\t') p++;
+    }
+    return n;
+}
+
+static void* batch_worker(void* arg){
+    job_queue_t* q = (job_queue_t*)arg;
+    for(;;){
+        pthread_mutex_lock(&q->mu);
+        uint32_t i = q->next < q->count ? q->next++ : UINT32_MAX;
+        pthread_mutex_unlock(&q->mu);
+        if(i == UINT32_MAX) return NULL;
+
+        job_t* j = &q->jobs[i];
+        TRACE_BEGIN(tj);
+        double t0 = now_ms();
+        cli_t jc;
+        health_t h; memset(&h, 0, sizeof(h));
+        int prc = parse_cli(j->argc, j->argv, &jc), rc;
+        if(prc!=0) rc = 2;
+        else if(jc.batch || jc.plan || jc.shards){ fprintf(stderr,"job %u: --batch/--plan/--shards not allowed in a job\n", i+1); rc = 2; }
+        else rc = build_image(jc, &h);
+        double ms = now_ms() - t0;
+        TRACE_END(tj, "job", i + 1);
+
+        // the prom refresh below reads every job's image and health under q->mu
+        pthread_mutex_lock(&q->mu);
+        j->image = jc.image; j->health = h; j->rc = rc; j->ms = ms;
+        if(q->prom){
+            uint32_t n = 0;
+            for(uint32_t k=0;k<q->count;k++){
+                if(!q->jobs[k].health.valid) continue;
+                q->images[n] = q->jobs[k].image; q->healths[n] = q->jobs[k].health; n++;
+            }
+            pthread_mutex_lock(&batch_lat_mu);
+            prom_write(q->prom, q->images, q->healths, n, batch_lat);
+            pthread_mutex_unlock(&batch_lat_mu);
+        }
+        pthread_mutex_unlock(&q->mu);
+    }
+}
+
+static int run_batch(const cli_t* c){
+    FILE* bf = fopen(c->batch, "r");
+    if(!bf){ perror("fopen --batch"); return 2; }
+    job_queue_t q; memset(&q, 0, sizeof(q));
+    pthread_mutex_init(&q.mu, NULL);
+    uint32_t cap = 0;
+    char line[8192];
+    int rc = 0;
+    while(fgets(line, sizeof(line), bf)){
+        size_t n = strcspn(line, "\r\n");
+        line[n] = 0;
+        size_t lead = strspn(line, " \t");
+        if(!line[lead] || line[lead]=='#') continue;
+        if(q.count == cap){
+            cap = cap ? cap*2 : 16;
+            job_t* nj = (job_t*)realloc(q.jobs, sizeof(job_t)*cap);
+            if(!nj){ rc = 1; break; }
+            q.jobs = nj;
+        }
+        job_t* j = &q.jobs[q.count];
+        memset(j, 0, sizeof(*j));
+        j->line = strdup(line);
+        if(!j->line){ rc = 1; break; }
+        q.count++;
+        j->argc = split_args(j->line, j->argv, 64);
+        if(j->argc < 0){ fprintf(stderr,"job %u: too many args\n", q.count); rc = 2; break; }
+    }
+    fclose(bf);
+
+    if(!rc && c->prom){
+        q.prom = c->prom;
+        q.images = (const char**)calloc(q.count ? q.count : 1, sizeof(*q.images));
+        q.healths = (health_t*)calloc(q.count ? q.count : 1, sizeof(*q.healths));
+        if(!q.images || !q.healths) rc = 1;
+    }
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t nthreads = c->jobs ? c->jobs : (ncpu > 0 ? (uint32_t)ncpu : 1);
+    if(nthreads > q.count) nthreads = q.count;
+    io_gate.limit = c->io_jobs;
+
+    double t0 = now_ms();
+    pthread_t* th = rc ? NULL : (pthread_t*)calloc(nthreads ? nthreads : 1, sizeof(pthread_t));
+    uint32_t started = 0;
+    if(th){
+        for(; started<nthreads; started++)
+            if(pthread_create(&th[started], NULL, batch_worker, &q)!=0) break;
+        if(!started && q.count) batch_worker(&q);  // no threads at all: build inline
+        for(uint32_t t=0;t<started;t++) pthread_join(th[t], NULL);
+    } else if(!rc) rc = 1;
+    double total = now_ms() - t0;
+
+    uint32_t failed = 0;
+    for(uint32_t i=0;i<q.count;i++){
+        if(!rc){
+            job_t* j = &q.jobs[i];
+            fprintf(stderr,"job %u '%s': %s in %.3f ms\n", i+1, j->image ? j->image : "?",
+                    j->rc ? "FAILED" : "ok", j->ms);
+            if(j->rc) failed++;
+        }
+        free(q.jobs[i].line);
     }
-    fprintf(stdout,"Created MiniVSFS image '%s' (%" PRIu64 " blocks, %u inodes)\n",
-            cli.image, total_blocks, cli.inodes);
+    if(!rc){
+        fprintf(stderr,"batch: %u images, %u failed, %u threads, %.3f ms wall\n",
+                q.count, failed, started ? started : 1, total);
+        if(c->stats){
+            static char buf[4096]; size_t n = 0;
+            if(c->stats == 2) bprintf(buf, sizeof(buf), &n, "{\"batch\":true,");
+            lat_format(buf, sizeof(buf), &n, batch_lat, c->stats == 2);
+            if(c->stats == 2) bprintf(buf, sizeof(buf), &n, "}\n");
+            fputs(buf, stderr);
+        }
+        if(failed) rc = 1;
+    }
+    free(th); free(q.jobs); free(q.images); free(q.healths);
+    pthread_mutex_destroy(&q.mu);
+    return rc;
+}
+
+//  --shards N: the file set is hashed by name over N images, each built on
+//  its own thread with its own buffer and bitmaps. <image> becomes a small
+//  text shard map naming them, which vsfs_cat reads as one namespace.
+
+// FNV-1a over the on-disk name; vsfs_cat routes lookups with the same hash
+static uint32_t shard_of(const char* name, size_t len, uint32_t n){
+    uint32_t h = 2166136261u;
+    for(size_t i=0;i<len && name[i];i++){ h ^= (uint8_t)name[i]; h *= 16777619u; }
+    return h % n;
+}
+
+typedef struct {
+    cli_t    cli;
+    char     path[4096];
+    int      rc;
+    health_t health;
+} shard_job_t;
+
+typedef struct {
+    shard_job_t* jobs;
+    uint32_t     count;
+    atomic_uint  next;
+} shard_queue_t;
+
+static void* shard_worker(void* arg){
+    shard_queue_t* q = (shard_queue_t*)arg;
+    for(;;){
+        uint32_t i = atomic_fetch_add(&q->next, 1);
+        if(i >= q->count) return NULL;
+        q->jobs[i].rc = build_image(q->jobs[i].cli, &q->jobs[i].health);
+    }
+}
+
+static int write_shard_map(const char* path, const shard_job_t* jobs, uint32_t n){
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if(fd < 0){ perror("shard map"); return -1; }
+    FILE* f = fdopen(fd, "w");
+    if(!f){ close(fd); unlink(tmp); return -1; }
+    fprintf(f, "mvsfs-shards 1 count %u hash fnv1a32\n", n);
+    for(uint32_t i=0;i<n;i++) fprintf(f, "%s\n", base_name(jobs[i].path));   // next to the map
+    int ok = fchmod(fd, 0644)==0;
+    if(fclose(f)!=0) ok = 0;
+    if(!ok || rename(tmp, path)!=0){ perror("shard map"); unlink(tmp); return -1; }
     return 0;
 }
+
+static int run_shards(const cli_t* c){
+    stats_t st; memset(&st, 0, sizeof(st));
+    src_set_t all; memset(&all, 0, sizeof(all));
+    all.indirect = c->indirect;
+    int rc = c->from_dir ? scan_dir(c->from_dir, &all, &st) : scan_manifest(c->manifest, &all, &st);
+    if(rc!=0){ src_set_free(&all); return 4; }
+
+    shard_queue_t q; memset(&q, 0, sizeof(q));
+    q.count = c->shards;
+    q.jobs = (shard_job_t*)calloc(q.count, sizeof(*q.jobs));
+    if(!q.jobs){ src_set_free(&all); return 1; }
+    for(uint32_t i=0;i<q.count && !rc;i++){
+        shard_job_t* j = &q.jobs[i];
+        j->cli = *c;
+        j->cli.shards = 0; j->cli.prom = NULL;
+        snprintf(j->path, sizeof(j->path), "%s.s%u", c->image, i);
+        j->cli.image = j->path;
+        if(!(j->cli.shard_src = (src_set_t*)calloc(1, sizeof(src_set_t)))) rc = 1;
+    }
+    // hand each file (and its path) to its shard
+    for(uint32_t k=0;k<all.count && !rc;k++){
+        src_file_t* f = &all.files[k];
+        src_set_t* s = q.jobs[shard_of(f->name, f->namelen, q.count)].cli.shard_src;
+        if(s->count == s->cap){
+            uint32_t ncap = s->cap ? s->cap*2 : 64;
+            src_file_t* nf = (src_file_t*)realloc(s->files, sizeof(src_file_t)*ncap);
+            if(!nf){ rc = 1; break; }
+            s->files = nf; s->cap = ncap;
+        }
+        s->files[s->count++] = *f;
+        s->data_blocks += f->blocks + map_blocks(f->blocks);
+        f->path = NULL;
+    }
+    if(rc){
+        for(uint32_t i=0;i<q.count;i++) if(q.jobs[i].cli.shard_src){ src_set_free(q.jobs[i].cli.shard_src); free(q.jobs[i].cli.shard_src); }
+        src_set_free(&all); free(q.jobs); return 1;
+    }
+    uint32_t nfiles = all.count;
+    src_set_free(&all);    // paths now belong to the shards
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t nthreads = c->jobs ? c->jobs : (ncpu > 0 ? (uint32_t)ncpu : 1);
+    if(nthreads > q.count) nthreads = q.count;
+    io_gate.limit = c->io_jobs;
+    pthread_t th[64];
+    uint32_t started = 0;
+    for(; started<nthreads; started++)
+        if(pthread_create(&th[started], NULL, shard_worker, &q)!=0) break;
+    if(!started) shard_worker(&q);
+    for(uint32_t t=0;t<started;t++) pthread_join(th[t], NULL);
+
+    for(uint32_t i=0;i<q.count && !rc;i++) rc = q.jobs[i].rc;
+    if(!rc && write_shard_map(c->image, q.jobs, q.count)!=0) rc = 5;
+    if(!rc) fprintf(stdout,"Created shard map '%s' (%u shards, %u files)\n", c->image, q.count, nfiles);
+    if(!rc && c->prom){
+        const char* images[64]; health_t hs[64];
+        for(uint32_t i=0;i<q.count;i++){ images[i] = q.jobs[i].path; hs[i] = q.jobs[i].health; }
+        prom_write(c->prom, images, hs, q.count, batch_lat);
+    }
+    free(q.jobs);
+    return rc;
+}
+
+int main(int argc, char** argv){
+    crc32_init();
+    cli_t cli; if(parse_cli(argc, argv, &cli)!=0) return 2;
+#ifndef VSFS_TRACE
+    if(cli.trace){ fprintf(stderr,"--trace needs a build with -DVSFS_TRACE\n"); return 2; }
+#endif
+    int rc = cli.batch ? run_batch(&cli) : cli.shards ? run_shards(&cli) : build_image(cli, NULL);
+#ifdef VSFS_TRACE
+    if(cli.trace && trace_dump(cli.trace)!=0 && !rc) rc = 1;
+#endif
+    return rc;
+}
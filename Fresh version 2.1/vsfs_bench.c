@@ -0,0 +1,447 @@
+// vsfs_bench.c - microbenchmarks for the MiniVSFS core kernels
+// build: gcc -O2 -std=c17 -Wall -Wextra vsfs_bench.c -o vsfs_bench
+// run:   ./vsfs_bench [--reps N] [--min-ms MS] [--filter SUBSTR] [--no-perf]
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define DIRECT_MAX 12
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must be 116 bytes");
+
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[DIRECT_MAX];
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode must be 128 bytes");
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t inode_no;
+    uint8_t  type;
+    char     name[58];
+    uint8_t  checksum;
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t) == 64, "dirent must be 64 bytes");
+
+// - kernels, same code as mkfs_builder.c / mkfs_adder.c
+
+static uint32_t CRC32_TAB[256];
+static void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        CRC32_TAB[i]=c;
+    }
+}
+static uint32_t crc32(const void* data, size_t n){
+    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+static uint32_t superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    uint8_t block[BS]; memset(block, 0, BS);
+    memcpy(block, sb, sizeof(*sb));
+    uint32_t s = crc32(block, BS - 4);
+    sb->checksum = s;
+    return s;
+}
+static void inode_crc_finalize(inode_t* ino){
+    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
+    memset(&tmp[120], 0, 8);
+    uint32_t c = crc32(tmp, 120);
+    ino->inode_crc = (uint64_t)c;
+}
+static void dirent_checksum_finalize(dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];
+    de->checksum = x;
+}
+static inline int test_bit(const uint8_t* bmap, uint32_t idx){
+    return (bmap[idx >> 3] >> (idx & 7)) & 1u;
+}
+static inline void set_bit(uint8_t* bmap, uint32_t idx){
+    bmap[idx >> 3] |= (uint8_t)(1u << (idx & 7));
+}
+
+// - harness
+
+static volatile uint64_t sink;  // keeps results alive so nothing is optimized away
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+static uint64_t rng(void){
+    rng_state ^= rng_state << 13; rng_state ^= rng_state >> 7; rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_ns(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef struct {
+    const char* name;
+    void      (*run)(void* ctx, uint64_t iters);
+    void*       ctx;
+    uint64_t    bytes_per_op;   // 0: no GB/s column
+} bench_t;
+
+static int cmp_dbl(const void* a, const void* b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct { uint32_t reps; double min_ms; const char* filter; int no_perf; } cli_t;
+
+// - hardware counters: one perf_event_open group (cycles leads) around each
+//   measured rep; every column degrades to "-" when the group can't be opened
+
+enum { HW_CYCLES, HW_INSNS, HW_CMISS, HW_BMISS, HW_COUNT };
+
+typedef struct {
+    int      fd[HW_COUNT];     // -1: counter not available
+    int      leader;
+    uint64_t val[HW_COUNT];    // sum over the measured reps
+} hw_t;
+
+static void hw_open(hw_t* hw, int disabled){
+    for(int i=0;i<HW_COUNT;i++) hw->fd[i] = -1;
+    hw->leader = -1;
+#ifdef __linux__
+    if(disabled) return;
+    static const uint64_t cfg[HW_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+    for(int i=0;i<HW_COUNT;i++){
+        struct perf_event_attr a; memset(&a, 0, sizeof(a));
+        a.size = sizeof(a);
+        a.type = PERF_TYPE_HARDWARE;
+        a.config = cfg[i];
+        a.disabled = hw->leader < 0;
+        a.exclude_kernel = 1;
+        a.exclude_hv = 1;
+        a.read_format = PERF_FORMAT_GROUP;
+        hw->fd[i] = (int)syscall(SYS_perf_event_open, &a, 0, -1, hw->leader, 0);
+        if(hw->fd[i] >= 0 && hw->leader < 0) hw->leader = hw->fd[i];
+    }
+    if(hw->leader < 0)
+        fprintf(stderr,"note: perf_event_open unavailable (perf_event_paranoid / container?), "
+                       "hardware counter columns disabled\n");
+#else
+    (void)disabled;
+#endif
+}
+
+static void hw_reset(hw_t* hw){ memset(hw->val, 0, sizeof(hw->val)); }
+
+static void hw_start(hw_t* hw){
+#ifdef __linux__
+    if(hw->leader < 0) return;
+    ioctl(hw->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(hw->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#else
+    (void)hw;
+#endif
+}
+
+static void hw_stop(hw_t* hw){
+#ifdef __linux__
+    if(hw->leader < 0) return;
+    ioctl(hw->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t buf[1 + HW_COUNT];
+    ssize_t n = read(hw->leader, buf, sizeof(buf));
+    if(n < (ssize_t)sizeof(uint64_t)) return;
+    // group values come back in open order, skipping counters that failed to open
+    uint64_t k = 1;
+    for(int i=0;i<HW_COUNT && k <= buf[0];i++)
+        if(hw->fd[i] >= 0) hw->val[i] += buf[k++];
+#else
+    (void)hw;
+#endif
+}
+
+static hw_t hw;
+
+// Calibrates iterations to ~min_ms per rep, warms up, then reports the median
+// ns/op over reps plus min and median absolute deviation
+static void bench_run(const bench_t* b, const cli_t* c){
+    if(c->filter && !strstr(b->name, c->filter)) return;
+    uint64_t iters = 1;
+    for(;;){
+        double t0 = now_ns();
+        b->run(b->ctx, iters);
+        double dt = now_ns() - t0;
+        if(dt >= c->min_ms * 1e6 || iters >= (1ull<<40)) break;
+        iters *= dt > 0 ? (dt*10 < c->min_ms*1e6 ? 10 : 2) : 10;
+    }
+    b->run(b->ctx, iters);  // warmup at the final size
+
+    double* ns = (double*)malloc(sizeof(double) * c->reps);
+    double* dev = (double*)malloc(sizeof(double) * c->reps);
+    if(!ns || !dev){ free(ns); free(dev); return; }
+    hw_reset(&hw);
+    for(uint32_t r=0;r<c->reps;r++){
+        hw_start(&hw);
+        double t0 = now_ns();
+        b->run(b->ctx, iters);
+        ns[r] = (now_ns() - t0) / (double)iters;
+        hw_stop(&hw);
+    }
+    double ops = (double)iters * c->reps;
+    qsort(ns, c->reps, sizeof(double), cmp_dbl);
+    double med = ns[c->reps/2];
+    for(uint32_t r=0;r<c->reps;r++) dev[r] = ns[r] > med ? ns[r]-med : med-ns[r];
+    qsort(dev, c->reps, sizeof(double), cmp_dbl);
+    double mad = dev[c->reps/2];
+
+    printf("%-34s %12.2f %12.2f %7.2f%%", b->name, med, ns[0], med > 0 ? 100.0*mad/med : 0.0);
+    if(b->bytes_per_op) printf(" %9.3f", (double)b->bytes_per_op / med);  // bytes/ns == GB/s
+    else printf(" %9s", "-");
+    if(hw.fd[HW_CYCLES] >= 0 && hw.fd[HW_INSNS] >= 0 && hw.val[HW_CYCLES])
+        printf(" %6.2f", (double)hw.val[HW_INSNS] / (double)hw.val[HW_CYCLES]);
+    else printf(" %6s", "-");
+    if(hw.fd[HW_CYCLES] >= 0) printf(" %10.1f", (double)hw.val[HW_CYCLES] / ops);
+    else printf(" %10s", "-");
+    if(hw.fd[HW_CMISS] >= 0) printf(" %10.4f", (double)hw.val[HW_CMISS] / ops);
+    else printf(" %10s", "-");
+    if(hw.fd[HW_BMISS] >= 0) printf(" %10.4f", (double)hw.val[HW_BMISS] / ops);
+    else printf(" %10s", "-");
+    printf("\n");
+    free(ns); free(dev);
+}
+
+// - benchmarks
+
+typedef struct { uint8_t* buf; size_t n; } crc_ctx_t;
+static void run_crc32(void* ctx, uint64_t iters){
+    crc_ctx_t* c = (crc_ctx_t*)ctx;
+    uint32_t acc = 0;
+    for(uint64_t i=0;i<iters;i++){ c->buf[0] = (uint8_t)i; acc ^= crc32(c->buf, c->n); }
+    sink = acc;
+}
+
+static void run_inode_crc(void* ctx, uint64_t iters){
+    inode_t* ino = (inode_t*)ctx;
+    for(uint64_t i=0;i<iters;i++){ ino->mtime = i; inode_crc_finalize(ino); }
+    sink = ino->inode_crc;
+}
+
+static void run_sb_crc(void* ctx, uint64_t iters){
+    superblock_t* sb = (superblock_t*)ctx;
+    uint32_t acc = 0;
+    for(uint64_t i=0;i<iters;i++){ sb->mtime_epoch = i; acc ^= superblock_crc_finalize(sb); }
+    sink = acc;
+}
+
+static void run_dirent_csum(void* ctx, uint64_t iters){
+    dirent64_t* de = (dirent64_t*)ctx;
+    uint32_t acc = 0;
+    for(uint64_t i=0;i<iters;i++){ de->inode_no = (uint32_t)i; dirent_checksum_finalize(de); acc += de->checksum; }
+    sink = acc;
+}
+
+// bitmap of nbits with `fill` percent of the bits set at random
+typedef struct { uint8_t bmap[BS]; uint32_t nbits; } bmap_ctx_t;
+static void bmap_fill(bmap_ctx_t* b, uint32_t nbits, uint32_t fill_pct){
+    memset(b->bmap, 0, BS);
+    b->nbits = nbits;
+    for(uint32_t i=0;i<nbits;i++) if(rng() % 100 < fill_pct) set_bit(b->bmap, i);
+}
+// first-fit: the mkfs_adder inode / data block search
+static void run_first_free(void* ctx, uint64_t iters){
+    bmap_ctx_t* b = (bmap_ctx_t*)ctx;
+    uint64_t acc = 0;
+    for(uint64_t it=0;it<iters;it++){
+        uint32_t found = UINT32_MAX;
+        for(uint32_t i=0;i<b->nbits;i++) if(!test_bit(b->bmap, i)){ found = i; break; }
+        acc += found;
+    }
+    sink = acc;
+}
+// full pass counting free bits (what a free-space report does)
+static void run_count_free(void* ctx, uint64_t iters){
+    bmap_ctx_t* b = (bmap_ctx_t*)ctx;
+    uint64_t acc = 0;
+    for(uint64_t it=0;it<iters;it++){
+        for(uint32_t i=0;i<b->nbits;i++) acc += !test_bit(b->bmap, i);
+    }
+    sink = acc;
+}
+static void run_set_all(void* ctx, uint64_t iters){
+    bmap_ctx_t* b = (bmap_ctx_t*)ctx;
+    for(uint64_t it=0;it<iters;it++){
+        b->bmap[it % BS] = 0;
+        for(uint32_t i=0;i<b->nbits;i++) set_bit(b->bmap, i);
+    }
+    sink = b->bmap[0];
+}
+
+// root dir of `blocks` blocks with the first `used` dirent slots taken;
+// the search is mkfs_adder's first-empty-slot loop
+typedef struct { uint8_t* blks; uint32_t blocks; } dir_ctx_t;
+static void run_dirent_slot(void* ctx, uint64_t iters){
+    dir_ctx_t* d = (dir_ctx_t*)ctx;
+    uint64_t acc = 0;
+    for(uint64_t it=0;it<iters;it++){
+        int found = -1;
+        for(uint32_t b=0;b<d->blocks && found<0;b++){
+            uint8_t* blk = d->blks + (size_t)b*BS;
+            for(int i=0;i<(int)(BS/sizeof(dirent64_t));i++){
+                dirent64_t* e = (dirent64_t*)(blk + i*sizeof(dirent64_t));
+                if(e->inode_no==0){ found = (int)(b*(BS/sizeof(dirent64_t))) + i; break; }
+            }
+        }
+        acc += (uint64_t)found;
+    }
+    sink = acc;
+}
+static void dir_fill(dir_ctx_t* d, uint32_t blocks, uint32_t used){
+    d->blocks = blocks;
+    memset(d->blks, 0, (size_t)blocks*BS);
+    for(uint32_t i=0;i<used && i<blocks*(BS/sizeof(dirent64_t));i++){
+        dirent64_t* e = (dirent64_t*)(d->blks + (size_t)i*sizeof(dirent64_t));
+        e->inode_no = i + 1; e->type = 1;
+        snprintf(e->name, sizeof(e->name), "file_%u", i);
+        dirent_checksum_finalize(e);
+    }
+}
+
+static int parse_cli(int argc, char** argv, cli_t* c){
+    memset(c, 0, sizeof(*c));
+    c->reps = 15; c->min_ms = 20;
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"--reps") && i+1<argc) c->reps = (uint32_t)strtoul(argv[++i],NULL,10);
+        else if(!strcmp(argv[i],"--min-ms") && i+1<argc) c->min_ms = strtod(argv[++i],NULL);
+        else if(!strcmp(argv[i],"--filter") && i+1<argc) c->filter = argv[++i];
+        else if(!strcmp(argv[i],"--no-perf")) c->no_perf = 1;
+        else { fprintf(stderr,"Unknown/invalid arg: %s\n", argv[i]); return -1; }
+    }
+    if(c->reps < 3){ fprintf(stderr,"--reps must be >= 3\n"); return -1; }
+    if(c->min_ms <= 0){ fprintf(stderr,"--min-ms must be > 0\n"); return -1; }
+    return 0;
+}
+
+int main(int argc, char** argv){
+    crc32_init();
+    cli_t cli; if(parse_cli(argc, argv, &cli)!=0) return 2;
+
+    static uint8_t crcbuf[65536];
+    for(size_t i=0;i<sizeof(crcbuf);i++) crcbuf[i] = (uint8_t)rng();
+    static crc_ctx_t crc_ctx[] = { {crcbuf, 64}, {crcbuf, 120}, {crcbuf, BS}, {crcbuf, 65536} };
+
+    inode_t ino; memset(&ino, 0, sizeof(ino));
+    ino.mode = 0100000; ino.links = 1; ino.size_bytes = 12345;
+    for(int i=0;i<DIRECT_MAX;i++) ino.direct[i] = 100 + i;
+
+    superblock_t sb; memset(&sb, 0, sizeof(sb));
+    sb.magic = 0x4D565346u; sb.version = 1; sb.block_size = BS;
+    sb.total_blocks = 1024; sb.inode_count = 256;
+
+    dirent64_t de; memset(&de, 0, sizeof(de));
+    de.type = 1; memcpy(de.name, "file_13.txt", 11);
+
+    // inode bitmap: 512 bits (max --inodes); data bitmap: 1020 bits (4 MiB image) and a full block
+    static const uint32_t fills[] = { 0, 50, 90, 99, 100 };
+    enum { NFILL = sizeof(fills)/sizeof(fills[0]) };
+    static bmap_ctx_t ib[NFILL], db[NFILL], dbf[NFILL];
+    static char names[3*NFILL + 4][48];
+    uint32_t ni = 0;
+
+    static uint8_t dirblks[DIRECT_MAX*BS];
+    static dir_ctx_t dir_ctx[4];
+    static const uint32_t dir_shape[4][2] = { {1,2}, {1,63}, {4,200}, {12,766} };
+
+    bench_t benches[64]; uint32_t nb = 0;
+    benches[nb++] = (bench_t){"crc32/64B",            run_crc32, &crc_ctx[0], 64};
+    benches[nb++] = (bench_t){"crc32/120B",           run_crc32, &crc_ctx[1], 120};
+    benches[nb++] = (bench_t){"crc32/4KiB",           run_crc32, &crc_ctx[2], BS};
+    benches[nb++] = (bench_t){"crc32/64KiB",          run_crc32, &crc_ctx[3], 65536};
+    benches[nb++] = (bench_t){"inode_crc_finalize",   run_inode_crc, &ino, INODE_SIZE};
+    benches[nb++] = (bench_t){"superblock_crc_finalize", run_sb_crc, &sb, BS};
+    benches[nb++] = (bench_t){"dirent_checksum_finalize", run_dirent_csum, &de, sizeof(de)};
+    for(uint32_t f=0;f<NFILL;f++){
+        bmap_fill(&ib[f], 512, fills[f]);
+        bmap_fill(&db[f], 1020, fills[f]);
+        bmap_fill(&dbf[f], BS*8, fills[f]);
+        snprintf(names[ni], sizeof(names[ni]), "inode_bmap/first_free/%u%%", fills[f]);
+        benches[nb++] = (bench_t){names[ni++], run_first_free, &ib[f], 0};
+        snprintf(names[ni], sizeof(names[ni]), "data_bmap/first_free/%u%%", fills[f]);
+        benches[nb++] = (bench_t){names[ni++], run_first_free, &db[f], 0};
+        snprintf(names[ni], sizeof(names[ni]), "data_bmap32k/count_free/%u%%", fills[f]);
+        benches[nb++] = (bench_t){names[ni++], run_count_free, &dbf[f], BS};
+    }
+    static bmap_ctx_t setb; setb.nbits = BS*8;
+    benches[nb++] = (bench_t){"data_bmap32k/set_bit_all", run_set_all, &setb, BS};
+    for(uint32_t d=0;d<4;d++){
+        dir_ctx[d].blks = dirblks;
+        snprintf(names[ni], sizeof(names[ni]), "dirent_slot/%ublk/%uused", dir_shape[d][0], dir_shape[d][1]);
+        benches[nb++] = (bench_t){names[ni++], run_dirent_slot, &dir_ctx[d], 0};
+    }
+
+    hw_open(&hw, cli.no_perf);
+    printf("%-34s %12s %12s %8s %9s %6s %10s %10s %10s\n", "benchmark", "ns/op(med)", "ns/op(min)",
+           "MAD", "GB/s", "IPC", "cyc/op", "cmiss/op", "bmiss/op");
+    for(uint32_t i=0;i<nb;i++){
+        // dirent slot benches share one buffer, so lay it out right before each run
+        for(uint32_t d=0;d<4;d++)
+            if(benches[i].ctx == &dir_ctx[d]) dir_fill(&dir_ctx[d], dir_shape[d][0], dir_shape[d][1]);
+        bench_run(&benches[i], &cli);
+    }
+    return 0;
+}
@@ -0,0 +1,1245 @@
+// vsfs_cat.c - read files back out of a MiniVSFS image
+// build: gcc -O2 -std=c17 -Wall -Wextra -pthread vsfs_cat.c -o vsfs_cat
+// run:   ./vsfs_cat --image <img> --ls
+//        ./vsfs_cat --image <img> --cat <name> [--cat <name>]...   (file bytes to stdout)
+//        add --range <off>[:<len>] to --cat to print only part of each file;
+//        ./vsfs_cat --image <img> --extract <dir>                   (every file in / into dir)
+//        add --trace-blocks <file> to log every block read, --jobs <n> to extract on n threads;
+//        ./vsfs_cat --image <img> --replay <file> [--paced]        re-issues a logged trace
+// <img> may also be a packed .mvsp file or an object-store directory (see
+// vsfs_pack.c), the fast file of a tier set (vsfs_tier.c), or file 0 of a striped set
+// (mkfs_builder --stripes); all are detected. A shard map (mkfs_builder --shards) is
+// read as one namespace over its images. --lazy maps the image and fetches blocks
+// on first touch through userfaultfd.
+//
+// Every block goes through one read path (fs_read), which sits on a block
+// device (bdev_t) so other image layouts can be plugged in underneath.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define DIRECT_MAX 12
+#define MAX_CAT 64
+
+#pragma pack(push, 1)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must be 116 bytes");
+
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[DIRECT_MAX];
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode must be 128 bytes");
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t inode_no;
+    uint8_t  type;
+    char     name[58];
+    uint8_t  checksum;
+} dirent64_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t) == 64, "dirent must be 64 bytes");
+
+// - helpers (same as mkfs_adder)
+
+static uint32_t CRC32_TAB[256];
+static void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        CRC32_TAB[i]=c;
+    }
+}
+static uint32_t crc32(const void* data, size_t n){
+    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+static int inode_crc_ok(const inode_t* ino){
+    return crc32(ino, 120) == (uint32_t)ino->inode_crc;
+}
+static int dirent_checksum_ok(const dirent64_t* de){
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];
+    return de->checksum == x;
+}
+
+static double now_ns(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//  Block devices: where image blocks physically come from
+
+typedef struct bdev {
+    uint64_t total_blocks;
+    int    (*read)(struct bdev* d, uint64_t blk, void* buf);   // 0 ok, -1 error
+    int    (*read_run)(struct bdev* d, uint64_t first, uint64_t n, void* buf);   // optional: n blocks in one I/O
+    void   (*close)(struct bdev* d);
+    int      fd;
+    void*    priv;
+    int      mt_safe;   // read() may be called from several threads at once
+} bdev_t;
+
+static int raw_read(bdev_t* d, uint64_t blk, void* buf){
+    uint8_t* p = (uint8_t*)buf;
+    size_t got = 0;
+    while(got < BS){
+        ssize_t r = pread(d->fd, p + got, BS - got, (off_t)(blk * BS + got));
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return -1;
+        got += (size_t)r;
+    }
+    return 0;
+}
+static void raw_close(bdev_t* d){ close(d->fd); }
+
+//  Packed images (.mvsp, written by vsfs_pack): chunked, LZ-compressed,
+//  read-only. Structures and decoder match vsfs_pack.c.
+
+#define PACK_MAGIC   0x5053564Du   // "MVSP"
+#define PACK_VERSION 1u
+enum { PACK_STORED, PACK_LZ, PACK_ZERO };
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t chunk_blocks;
+    uint64_t total_blocks;
+    uint64_t meta_blocks;
+    uint64_t nchunks;
+    uint64_t index_off;
+    uint32_t index_crc;
+    uint8_t  pad[8];
+    uint32_t header_crc;
+} pack_hdr_t;
+
+typedef struct {
+    uint64_t off;
+    uint32_t clen;
+    uint32_t crc;
+    uint32_t method;
+} pack_chunk_t;
+#pragma pack(pop)
+_Static_assert(sizeof(pack_hdr_t) == 64, "pack header must be 64 bytes");
+_Static_assert(sizeof(pack_chunk_t) == 20, "pack chunk entry must be 20 bytes");
+
+#define LZ_MIN_MATCH 4
+
+// Returns the decoded size, or -1 on corrupt input
+static long lz_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap){
+    const uint8_t* ip = src;
+    const uint8_t* end = src + n;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+    while(ip < end){
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if(lit == 15){
+            uint8_t b;
+            do { if(ip >= end) return -1; b = *ip++; lit += b; } while(b == 255);
+        }
+        if((size_t)(end - ip) < lit || (size_t)(oend - op) < lit) return -1;
+        memcpy(op, ip, lit); op += lit; ip += lit;
+        if(ip == end) break;
+
+        if(end - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t mlen = (token & 15u);
+        if(mlen == 15){
+            uint8_t b;
+            do { if(ip >= end) return -1; b = *ip++; mlen += b; } while(b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if(!off || off > (size_t)(op - dst) || (size_t)(oend - op) < mlen) return -1;
+        const uint8_t* ref = op - off;
+        for(size_t i=0;i<mlen;i++) op[i] = ref[i];     // may overlap
+        op += mlen;
+    }
+    return (long)(op - dst);
+}
+
+typedef struct {
+    pack_hdr_t    hdr;
+    pack_chunk_t* idx;
+    uint8_t*      cbuf;     // compressed payload
+    uint8_t*      chunk;    // last decoded chunk
+    uint64_t      cached;   // its number, UINT64_MAX if none
+} pack_t;
+
+static int pread_full(int fd, void* buf, size_t n, uint64_t off){
+    uint8_t* p = (uint8_t*)buf;
+    size_t got = 0;
+    while(got < n){
+        ssize_t r = pread(fd, p + got, n - got, (off_t)(off + got));
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return -1;
+        got += (size_t)r;
+    }
+    return 0;
+}
+
+static int raw_read_run(bdev_t* d, uint64_t first, uint64_t n, void* buf){
+    return pread_full(d->fd, buf, (size_t)(n * BS), first * BS);
+}
+
+static int pack_read(bdev_t* d, uint64_t blk, void* buf){
+    pack_t* pk = (pack_t*)d->priv;
+    const pack_hdr_t* h = &pk->hdr;
+    // O(1): metadata region is chunk 0, data blocks follow in fixed-size chunks
+    uint64_t c = blk < h->meta_blocks ? 0 : 1 + (blk - h->meta_blocks) / h->chunk_blocks;
+    uint64_t first = c ? h->meta_blocks + (c-1) * h->chunk_blocks : 0;
+    if(c != pk->cached){
+        const pack_chunk_t* e = &pk->idx[c];
+        uint64_t nblk = c ? h->chunk_blocks : h->meta_blocks;
+        if(first + nblk > h->total_blocks) nblk = h->total_blocks - first;
+        size_t ulen = (size_t)(nblk * BS);
+        pk->cached = UINT64_MAX;
+        if(e->method == PACK_ZERO) memset(pk->chunk, 0, ulen);
+        else if(e->method == PACK_STORED){
+            if(e->clen != ulen || pread_full(d->fd, pk->chunk, ulen, e->off) != 0) return -1;
+        } else if(e->method == PACK_LZ){
+            if(e->clen > ulen || pread_full(d->fd, pk->cbuf, e->clen, e->off) != 0) return -1;
+            if(lz_decompress(pk->cbuf, e->clen, pk->chunk, ulen) != (long)ulen) return -1;
+        } else return -1;
+        if(crc32(pk->chunk, ulen) != e->crc){ fprintf(stderr,"Chunk %" PRIu64 " checksum mismatch\n", c); return -1; }
+        pk->cached = c;
+    }
+    memcpy(buf, pk->chunk + (blk - first) * BS, BS);
+    return 0;
+}
+
+static void pack_close(bdev_t* d){
+    pack_t* pk = (pack_t*)d->priv;
+    free(pk->chunk); free(pk->cbuf); free(pk->idx); free(pk);
+    close(d->fd);
+}
+
+static int pack_open(bdev_t* d){
+    pack_t* pk = (pack_t*)calloc(1, sizeof(*pk));
+    if(!pk) return -1;
+    pack_hdr_t* h = &pk->hdr;
+    if(pread_full(d->fd, h, sizeof(*h), 0) != 0 || h->version != PACK_VERSION || h->block_size != BS ||
+       crc32(h, offsetof(pack_hdr_t, header_crc)) != h->header_crc || !h->chunk_blocks ||
+       h->meta_blocks > h->total_blocks || h->meta_blocks > 1024 || h->chunk_blocks > 256 ||
+       h->nchunks != 1 + (h->total_blocks - h->meta_blocks + h->chunk_blocks - 1) / h->chunk_blocks){
+        fprintf(stderr,"Corrupt .mvsp header\n"); free(pk); return -1;
+    }
+    size_t max_chunk = (size_t)(h->meta_blocks > h->chunk_blocks ? h->meta_blocks : h->chunk_blocks) * BS;
+    pk->idx = (pack_chunk_t*)malloc(h->nchunks * sizeof(*pk->idx));
+    pk->cbuf = (uint8_t*)malloc(max_chunk);
+    pk->chunk = (uint8_t*)malloc(max_chunk);
+    pk->cached = UINT64_MAX;
+    if(!pk->idx || !pk->cbuf || !pk->chunk ||
+       pread_full(d->fd, pk->idx, h->nchunks * sizeof(*pk->idx), h->index_off) != 0 ||
+       crc32(pk->idx, h->nchunks * sizeof(*pk->idx)) != h->index_crc){
+        fprintf(stderr,"Corrupt .mvsp chunk index\n");
+        free(pk->chunk); free(pk->cbuf); free(pk->idx); free(pk); return -1;
+    }
+    d->total_blocks = h->total_blocks;
+    d->priv = pk;
+    d->read = pack_read; d->close = pack_close;
+    return 0;
+}
+
+//  Object-store directory (vsfs_pack --objstore): a manifest plus one raw
+//  object per chunk_blocks; a missing object reads as zeros. Stands in for
+//  fetching whole objects from remote storage.
+
+typedef struct {
+    uint32_t chunk_blocks;
+    uint8_t* obj;       // last fetched object
+    uint64_t cached;    // its number, UINT64_MAX if none
+    uint64_t fetches;
+} objstore_t;
+
+static int objstore_read(bdev_t* d, uint64_t blk, void* buf){
+    objstore_t* os = (objstore_t*)d->priv;
+    uint64_t o = blk / os->chunk_blocks;
+    if(o != os->cached){
+        uint64_t first = o * os->chunk_blocks;
+        uint64_t nblk = first + os->chunk_blocks > d->total_blocks ? d->total_blocks - first : os->chunk_blocks;
+        char name[32];
+        snprintf(name, sizeof(name), "%08" PRIu64 ".blk", o);
+        os->cached = UINT64_MAX;
+        int fd = openat(d->fd, name, O_RDONLY);
+        if(fd < 0 && errno != ENOENT) return -1;
+        if(fd < 0) memset(os->obj, 0, (size_t)(nblk * BS));
+        else {
+            int r = pread_full(fd, os->obj, (size_t)(nblk * BS), 0);
+            close(fd);
+            if(r != 0) return -1;
+        }
+        os->cached = o;
+        os->fetches++;
+    }
+    memcpy(buf, os->obj + (blk - o * os->chunk_blocks) * BS, BS);
+    return 0;
+}
+
+static void objstore_close(bdev_t* d){
+    objstore_t* os = (objstore_t*)d->priv;
+    free(os->obj); free(os);
+    close(d->fd);
+}
+
+static int objstore_open(bdev_t* d){
+    int mfd = openat(d->fd, "manifest", O_RDONLY);
+    FILE* mf = mfd < 0 ? NULL : fdopen(mfd, "r");
+    if(!mf){ fprintf(stderr,"Not an object store (no manifest)\n"); if(mfd >= 0) close(mfd); return -1; }
+    unsigned ver = 0, cb = 0; unsigned long long total = 0;
+    int n = fscanf(mf, "mvsfs-objstore %u total_blocks %llu chunk_blocks %u", &ver, &total, &cb);
+    fclose(mf);
+    if(n != 3 || ver != 1 || !total || !cb || cb > 256){ fprintf(stderr,"Bad object store manifest\n"); return -1; }
+    objstore_t* os = (objstore_t*)calloc(1, sizeof(*os));
+    if(!os || !(os->obj = (uint8_t*)malloc((size_t)cb * BS))){ free(os); return -1; }
+    os->chunk_blocks = cb;
+    os->cached = UINT64_MAX;
+    d->total_blocks = total;
+    d->priv = os;
+    d->read = objstore_read; d->close = objstore_close;
+    return 0;
+}
+
+//  Tier sets (vsfs_tier): the fast file holds a remap table and the metadata
+//  plus hot blocks; everything else is read from the slow file at its home
+//  offset. The table is read once at open, under a shared flock that is held
+//  until close: vsfs_tier migrates under an exclusive one, so it never refills
+//  a slot this table still names.
+
+#define TIER_MAGIC   0x5253564Du   // "MVSR"
+#define TIER_VERSION 2u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t fast_slots;
+    uint64_t total_blocks;
+    uint64_t meta_blocks;
+    uint64_t epoch;
+    uint32_t table_crc;
+    uint32_t table_copy;   // live remap table: 0 or 1
+    char     slow_path[204];
+    uint32_t header_crc;
+} tier_hdr_t;
+#pragma pack(pop)
+_Static_assert(sizeof(tier_hdr_t) == 256, "tier header must be 256 bytes");
+
+typedef struct {
+    uint32_t* table;       // 0: slow file, s+1: fast slot s
+    int       slow_fd;
+    uint64_t  slot_base;
+    uint32_t  fast_slots;
+} tier_t;
+
+static int tier_read(bdev_t* d, uint64_t blk, void* buf){
+    tier_t* t = (tier_t*)d->priv;
+    uint32_t e = t->table[blk];
+    if(e) return pread_full(d->fd, buf, BS, t->slot_base + (uint64_t)(e - 1) * BS);
+    return pread_full(t->slow_fd, buf, BS, blk * BS);
+}
+
+static void tier_close(bdev_t* d){
+    tier_t* t = (tier_t*)d->priv;
+    close(t->slow_fd); free(t->table); free(t);
+    close(d->fd);
+}
+
+static int tier_open(bdev_t* d, const char* fast){
+    while(flock(d->fd, LOCK_SH) != 0){
+        if(errno != EINTR){ perror("flock tier set"); return -1; }
+    }
+    tier_hdr_t h;
+    if(pread_full(d->fd, &h, sizeof(h), 0) != 0 || h.version != TIER_VERSION || h.block_size != BS ||
+       crc32(&h, offsetof(tier_hdr_t, header_crc)) != h.header_crc || h.total_blocks > (1u << 24) ||
+       h.table_copy > 1){
+        fprintf(stderr,"Corrupt tier header\n"); return -1;
+    }
+    tier_t* t = (tier_t*)calloc(1, sizeof(*t));
+    if(!t) return -1;
+    t->table = (uint32_t*)malloc(h.total_blocks * 4);
+    uint64_t table_at = sizeof(h) + h.table_copy * h.total_blocks * 4;
+    if(!t->table || pread_full(d->fd, t->table, h.total_blocks * 4, table_at) != 0 ||
+       crc32(t->table, h.total_blocks * 4) != h.table_crc){
+        fprintf(stderr,"Corrupt tier remap table\n"); free(t->table); free(t); return -1;
+    }
+    for(uint64_t b=0;b<h.total_blocks;b++){
+        if(t->table[b] > h.fast_slots){ fprintf(stderr,"Corrupt tier remap table\n"); free(t->table); free(t); return -1; }
+    }
+    t->slot_base = (sizeof(h) + 2 * h.total_blocks * 4 + BS - 1) / BS * BS;
+    t->fast_slots = h.fast_slots;
+
+    char path[4096];
+    h.slow_path[sizeof(h.slow_path)-1] = '\0';
+    const char* slash = strrchr(fast, '/');
+    if(h.slow_path[0] == '/' || !slash) snprintf(path, sizeof(path), "%s", h.slow_path);
+    else snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - fast), fast, h.slow_path);
+    t->slow_fd = open(path, O_RDONLY);
+    if(t->slow_fd < 0){ perror(path); free(t->table); free(t); return -1; }
+    d->total_blocks = h.total_blocks;
+    d->priv = t;
+    d->read = tier_read; d->close = tier_close;
+    d->mt_safe = 1;
+    return 0;
+}
+
+//  Striped images (mkfs_builder --stripes): file 0 holds a header block and
+//  the metadata, the data region is spread round-robin over all N files in
+//  stripe_blocks units. Files 1..N-1 sit next to file 0 as <image>.1 ...
+
+#define STRIPE_MAGIC   0x5353564Du   // "MVSS"
+#define STRIPE_VERSION 1u
+#define STRIPE_MAX     16u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t stripes;
+    uint32_t stripe_blocks;
+    uint64_t total_blocks;
+    uint64_t meta_blocks;
+    uint32_t header_crc;
+} stripe_hdr_t;
+#pragma pack(pop)
+
+typedef struct {
+    stripe_hdr_t h;
+    int          fds[STRIPE_MAX];   // fds[0] is d->fd
+} stripe_t;
+
+static int stripe_read(bdev_t* d, uint64_t blk, void* buf){
+    stripe_t* s = (stripe_t*)d->priv;
+    const stripe_hdr_t* h = &s->h;
+    if(blk < h->meta_blocks) return pread_full(d->fd, buf, BS, (1 + blk) * BS);
+    uint64_t db = blk - h->meta_blocks, u = db / h->stripe_blocks;
+    uint32_t f = (uint32_t)(u % h->stripes);
+    uint64_t off = ((u / h->stripes) * h->stripe_blocks + db % h->stripe_blocks) * BS;
+    if(f == 0) off += (1 + h->meta_blocks) * BS;
+    return pread_full(s->fds[f], buf, BS, off);
+}
+
+// The metadata sits in file 0 right after the header block
+static int stripe_read_run(bdev_t* d, uint64_t first, uint64_t n, void* buf){
+    stripe_t* s = (stripe_t*)d->priv;
+    if(first + n > s->h.meta_blocks){
+        for(uint64_t i=0;i<n;i++) if(stripe_read(d, first + i, (uint8_t*)buf + i * BS) != 0) return -1;
+        return 0;
+    }
+    return pread_full(d->fd, buf, (size_t)(n * BS), (1 + first) * BS);
+}
+
+static void stripe_close(bdev_t* d){
+    stripe_t* s = (stripe_t*)d->priv;
+    for(uint32_t f=1; f<s->h.stripes; f++) if(s->fds[f] >= 0) close(s->fds[f]);
+    free(s);
+    close(d->fd);
+}
+
+static int stripe_open(bdev_t* d, const char* path){
+    stripe_t* s = (stripe_t*)calloc(1, sizeof(*s));
+    if(!s) return -1;
+    stripe_hdr_t* h = &s->h;
+    if(pread_full(d->fd, h, sizeof(*h), 0) != 0 || h->version != STRIPE_VERSION || h->block_size != BS ||
+       crc32(h, offsetof(stripe_hdr_t, header_crc)) != h->header_crc ||
+       h->stripes < 2 || h->stripes > STRIPE_MAX || !h->stripe_blocks || h->meta_blocks > h->total_blocks){
+        fprintf(stderr,"Corrupt stripe header\n"); free(s); return -1;
+    }
+    s->fds[0] = d->fd;
+    for(uint32_t f=1; f<h->stripes; f++){
+        char p[4096];
+        snprintf(p, sizeof(p), "%.4000s.%u", path, f);
+        s->fds[f] = open(p, O_RDONLY);
+        if(s->fds[f] < 0){
+            perror(p);
+            while(--f) close(s->fds[f]);
+            free(s); return -1;
+        }
+    }
+    d->total_blocks = h->total_blocks;
+    d->priv = s;
+    d->read = stripe_read; d->close = stripe_close;
+    d->read_run = stripe_read_run;
+    d->mt_safe = 1;
+    return 0;
+}
+
+// A plain image file, a packed one, a tier set, a striped set, or an object-store directory
+static int bdev_open(const char* path, bdev_t* d){
+    memset(d, 0, sizeof(*d));
+    d->fd = open(path, O_RDONLY);
+    if(d->fd < 0){ perror("open image"); return -1; }
+    struct stat st;
+    if(fstat(d->fd, &st) == 0 && S_ISDIR(st.st_mode)){
+        if(objstore_open(d) != 0){ close(d->fd); return -1; }
+        return 0;
+    }
+    uint32_t magic = 0;
+    if(pread(d->fd, &magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) && magic == PACK_MAGIC){
+        if(pack_open(d) != 0){ close(d->fd); return -1; }
+        return 0;
+    }
+    if(magic == TIER_MAGIC){
+        if(tier_open(d, path) != 0){ close(d->fd); return -1; }
+        return 0;
+    }
+    if(magic == STRIPE_MAGIC){
+        if(stripe_open(d, path) != 0){ close(d->fd); return -1; }
+        return 0;
+    }
+    if(fstat(d->fd, &st) != 0 || st.st_size % BS){
+        fprintf(stderr,"Invalid image (size not multiple of block size)\n"); close(d->fd); return -1;
+    }
+    d->total_blocks = (uint64_t)st.st_size / BS;
+    d->read = raw_read; d->close = raw_close;
+    d->read_run = raw_read_run;
+    d->mt_safe = 1;
+    return 0;
+}
+
+//  --lazy: the whole image is one anonymous mapping registered with
+//  userfaultfd; a handler thread fills each page from the underlying
+//  device the first time it is touched. Opening costs nothing, and only
+//  the blocks actually read are fetched.
+
+typedef struct {
+    bdev_t    inner;        // where faulted pages come from
+    uint8_t*  map;
+    size_t    len;          // page-rounded
+    long      page;
+    int       uffd, stop[2];
+    pthread_t th;
+    uint8_t*  page_buf;
+    // bad and failed are set by the handler (release, before the page is
+    // published) and read by any reader thread (acquire, after its fault was served)
+    _Atomic uint8_t* bad;   // per block: the fetch failed, page was zero-filled
+    atomic_int failed;      // handler gave up; the range was unregistered
+    uint64_t  faults, fetched;   // handler thread only; read after it is joined
+} lazy_t;
+
+#ifdef __linux__
+static void* lazy_handler(void* arg){
+    lazy_t* lz = (lazy_t*)arg;
+    struct pollfd pf[2] = { { lz->uffd, POLLIN, 0 }, { lz->stop[0], POLLIN, 0 } };
+    for(;;){
+        if(poll(pf, 2, -1) < 0){ if(errno == EINTR) continue; break; }
+        if(pf[1].revents) return NULL;
+        struct uffd_msg msg;
+        ssize_t r = read(lz->uffd, &msg, sizeof(msg));
+        if(r < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        if(r != (ssize_t)sizeof(msg)) break;
+        if(msg.event != UFFD_EVENT_PAGEFAULT) continue;
+        uint64_t off = (msg.arg.pagefault.address - (uintptr_t)lz->map) & ~(uint64_t)(lz->page - 1);
+        for(uint64_t o=0; o<(uint64_t)lz->page; o+=BS){
+            uint64_t blk = (off + o) / BS;
+            if(blk < lz->inner.total_blocks && lz->inner.read(&lz->inner, blk, lz->page_buf + o) == 0){ lz->fetched++; continue; }
+            memset(lz->page_buf + o, 0, BS);
+            if(blk < lz->inner.total_blocks) atomic_store_explicit(&lz->bad[blk], 1, memory_order_release);
+        }
+        struct uffdio_copy cp = { .dst = (uintptr_t)lz->map + off, .src = (uintptr_t)lz->page_buf,
+                                  .len = (uint64_t)lz->page, .mode = 0 };
+        if(ioctl(lz->uffd, UFFDIO_COPY, &cp) != 0 && errno != EEXIST) break;
+        lz->faults++;
+    }
+    // don't leave a reader stuck on a fault nobody will serve: later touches get zero pages
+    atomic_store_explicit(&lz->failed, 1, memory_order_release);
+    struct uffdio_range rg = { (uintptr_t)lz->map, lz->len };
+    ioctl(lz->uffd, UFFDIO_UNREGISTER, &rg);
+    return NULL;
+}
+#endif
+
+static int lazy_read(bdev_t* d, uint64_t blk, void* buf){
+    lazy_t* lz = (lazy_t*)d->priv;
+    memcpy(buf, lz->map + blk * BS, BS);      // may fault; the handler fills the page first
+    return atomic_load_explicit(&lz->failed, memory_order_acquire) ||
+           atomic_load_explicit(&lz->bad[blk], memory_order_acquire) ? -1 : 0;
+}
+
+static void lazy_close(bdev_t* d){
+    lazy_t* lz = (lazy_t*)d->priv;
+    if(write(lz->stop[1], "x", 1) < 0) perror("lazy stop");
+    pthread_join(lz->th, NULL);
+    fprintf(stderr,"lazy: %" PRIu64 " page faults, %" PRIu64 " of %" PRIu64 " blocks fetched\n",
+            lz->faults, lz->fetched, lz->inner.total_blocks);
+    close(lz->stop[0]); close(lz->stop[1]); close(lz->uffd);
+    munmap(lz->map, lz->len);
+    lz->inner.close(&lz->inner);
+    free(lz->bad); free(lz->page_buf); free(lz);
+}
+
+// Wraps d in a lazy mapping; on failure d is left as it was and reads stay direct
+static int lazy_open(bdev_t* d){
+#ifdef __linux__
+    lazy_t* lz = (lazy_t*)calloc(1, sizeof(*lz));
+    if(!lz) return -1;
+    lz->page = sysconf(_SC_PAGESIZE);
+    lz->len = (size_t)((d->total_blocks * BS + (uint64_t)lz->page - 1) & ~(uint64_t)(lz->page - 1));
+    lz->uffd = lz->stop[0] = lz->stop[1] = -1;
+    const char* why = NULL;
+    long fd = -1;
+#ifdef UFFD_USER_MODE_ONLY
+    fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+#endif
+    if(fd < 0) fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    lz->uffd = (int)fd;
+    struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+    if(fd < 0) why = "userfaultfd";
+    else if(ioctl(lz->uffd, UFFDIO_API, &api) != 0) why = "UFFDIO_API";
+    else if((lz->map = (uint8_t*)mmap(NULL, lz->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+            == MAP_FAILED){ lz->map = NULL; why = "mmap"; }
+    else {
+        struct uffdio_register reg = { .range = { (uintptr_t)lz->map, lz->len }, .mode = UFFDIO_REGISTER_MODE_MISSING };
+        if(ioctl(lz->uffd, UFFDIO_REGISTER, &reg) != 0) why = "UFFDIO_REGISTER";
+        else if(!(lz->page_buf = (uint8_t*)malloc((size_t)lz->page)) ||
+                !(lz->bad = (_Atomic uint8_t*)calloc(d->total_blocks, 1))) why = "malloc";
+        else if(pipe(lz->stop) != 0) why = "pipe";
+    }
+    if(!why){
+        lz->inner = *d;
+        if(pthread_create(&lz->th, NULL, lazy_handler, lz) != 0) why = "pthread_create";
+    }
+    if(why){
+        fprintf(stderr,"lazy: %s failed (%s), reading blocks directly\n", why, strerror(errno));
+        if(lz->map) munmap(lz->map, lz->len);
+        if(lz->uffd >= 0) close(lz->uffd);
+        if(lz->stop[0] >= 0){ close(lz->stop[0]); close(lz->stop[1]); }
+        free(lz->bad); free(lz->page_buf); free(lz);
+        return -1;
+    }
+    bdev_t w; memset(&w, 0, sizeof(w));
+    w.total_blocks = d->total_blocks;
+    w.read = lazy_read; w.close = lazy_close;
+    w.fd = -1; w.priv = lz;
+    w.mt_safe = 1;      // one handler thread does every inner read
+    *d = w;
+    return 0;
+#else
+    (void)d;
+    fprintf(stderr,"lazy: userfaultfd needs Linux, reading blocks directly\n");
+    return -1;
+#endif
+}
+
+//  Block access trace (--trace-blocks): 8-byte header, then one 16-byte
+//  record per block read, in the order they were issued
+
+enum { OP_SUPER, OP_ITABLE, OP_DIR, OP_DATA, OP_HASH, OP_META, OP_PTR, OP_COUNT };
+static const char* OP_NAMES[OP_COUNT] = { "super", "itable", "dir", "data", "hash", "meta", "ptr" };
+
+#define TRACE_MAGIC 0x5453564Du   // "MVST"
+#define TRACE_VERSION 1u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint64_t ts_ns;       // since the image was opened
+    uint32_t block;       // absolute block number in the image
+    uint16_t inode;       // inode the read was for (0: none)
+    uint8_t  op;          // OP_*
+    uint8_t  pad;
+} trace_rec_t;
+#pragma pack(pop)
+_Static_assert(sizeof(trace_rec_t) == 16, "trace record must be 16 bytes");
+
+//  Perfect-hash directory table of finalized images (see vsfs_finalize.c)
+
+#define SB_FLAG_DIRHASH 0x1u
+#define DIRHASH_MAGIC   0x4853564Du // "MVSH"
+
+//  Indirect block maps (mkfs_builder --indirect): a regular file maps blocks
+//  12.. through reserved_0 (1024 block numbers) and then reserved_1 (1024
+//  such blocks). Pointer blocks are kept in a small cache so a large file
+//  read at random offsets does not fetch the same pointers again per block.
+
+#define SB_FLAG_INDIRECT 0x2u
+#define PTRS_PER_BLK (BS / 4u)
+#define PCACHE_SLOTS 32
+
+typedef struct { uint64_t blk; uint32_t ptr[PTRS_PER_BLK]; } pcache_ent_t;
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t nkeys;
+    uint32_t nbuckets;
+    uint32_t slots_off;
+    uint32_t disp_crc;
+    uint32_t pad[3];
+} dirhash_hdr_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirhash_hdr_t) == 32, "dirhash header must be 32 bytes");
+
+static uint64_t dirhash(const char* name, size_t len, uint32_t seed){
+    uint64_t h = 1469598103934665603ull;
+    for(int i=0;i<4;i++){ h ^= (uint8_t)(seed >> (8*i)); h *= 1099511628211ull; }
+    for(size_t i=0;i<len;i++){ h ^= (uint8_t)name[i]; h *= 1099511628211ull; }
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdull; h ^= h >> 33;
+    return h;
+}
+
+typedef struct {
+    bdev_t        dev;
+    superblock_t  sb;
+    FILE*         trace;
+    double        t0;
+    _Atomic uint64_t reads[OP_COUNT];
+    uint8_t*      meta;          // blocks 0..meta_blocks-1, read once at mount
+    uint64_t      meta_blocks;
+    int           dh_state;      // 0 not loaded, 1 loaded, -1 unusable
+    uint64_t      dh_start, dh_blocks;
+    dirhash_hdr_t dh;
+    uint32_t*     dh_disp;
+    pthread_mutex_t pc_mu;       // --jobs threads share the pointer cache
+    pcache_ent_t* pc;            // PCACHE_SLOTS entries, direct-mapped by block number
+} fs_t;
+
+// The one place image blocks are read; metadata comes from the copy made at mount
+static int fs_read(fs_t* fs, uint64_t blk, void* buf, uint32_t ino, int op){
+    if(blk >= fs->dev.total_blocks){ fprintf(stderr,"Block %" PRIu64 " out of range\n", blk); return -1; }
+    if(blk < fs->meta_blocks){ memcpy(buf, fs->meta + blk * BS, BS); return 0; }
+    if(fs->trace){
+        trace_rec_t r = { (uint64_t)(now_ns() - fs->t0), (uint32_t)blk, (uint16_t)ino, (uint8_t)op, 0 };
+        fwrite(&r, sizeof(r), 1, fs->trace);
+    }
+    fs->reads[op]++;
+    if(fs->dev.read(&fs->dev, blk, buf) != 0){ fprintf(stderr,"Read error on block %" PRIu64 "\n", blk); return -1; }
+    return 0;
+}
+
+// Bitmaps and inode table follow the superblock up to data_region_start:
+// fetch them in one sequential read so later lookups never seek for metadata.
+// Best effort; on failure blocks are read one by one as before.
+static void fs_preload(fs_t* fs, const uint8_t* blk0){
+    uint64_t n = fs->sb.data_region_start;
+    if(n < 2 || n > fs->dev.total_blocks || n > 64) return;
+    uint8_t* m = (uint8_t*)malloc((size_t)(n * BS));
+    if(!m) return;
+    memcpy(m, blk0, BS);     // block 0 was just read and checked
+    int rc = 0;
+    if(fs->dev.read_run) rc = fs->dev.read_run(&fs->dev, 1, n - 1, m + BS);
+    else for(uint64_t b=1; b<n && !rc; b++) rc = fs->dev.read(&fs->dev, b, m + b * BS);
+    if(rc != 0){ fprintf(stderr,"Metadata preload failed, reading it block by block\n"); free(m); return; }
+    if(fs->trace){
+        uint64_t t = (uint64_t)(now_ns() - fs->t0);
+        for(uint64_t b=1; b<n; b++){
+            trace_rec_t r = { t, (uint32_t)b, 0, OP_META, 0 };
+            fwrite(&r, sizeof(r), 1, fs->trace);
+        }
+    }
+    fs->reads[OP_META] += n - 1;
+    fs->meta = m;
+    fs->meta_blocks = n;
+}
+
+static int fs_mount(fs_t* fs, const char* trace_path){
+    fs->t0 = now_ns();
+    pthread_mutex_init(&fs->pc_mu, NULL);
+    if(trace_path){
+        fs->trace = fopen(trace_path, "wb");
+        if(!fs->trace){ perror("fopen trace"); return -1; }
+        uint32_t hdr[2] = { TRACE_MAGIC, TRACE_VERSION };
+        fwrite(hdr, sizeof(hdr), 1, fs->trace);
+    }
+    uint8_t blk[BS], blk0[BS];
+    if(fs_read(fs, 0, blk, 0, OP_SUPER) != 0) return -1;
+    memcpy(&fs->sb, blk, sizeof(fs->sb));
+    const superblock_t* sb = &fs->sb;
+    if(sb->magic != 0x4D565346u || sb->version != 1 || sb->block_size != BS){
+        fprintf(stderr,"Not a MiniVSFS image\n"); return -1;
+    }
+    memcpy(blk0, blk, BS);
+    memset(blk + offsetof(superblock_t, checksum), 0, 4);    // summed with the field zeroed
+    if(crc32(blk, BS - 4) != sb->checksum){ fprintf(stderr,"Superblock checksum mismatch\n"); return -1; }
+    if(sb->total_blocks != fs->dev.total_blocks){ fprintf(stderr,"Superblock total_blocks mismatch\n"); return -1; }
+    fs_preload(fs, blk0);
+    return 0;
+}
+
+static int fs_unmount(fs_t* fs){
+    int rc = 0;
+    if(fs->trace && fclose(fs->trace) != 0){ perror("trace"); rc = -1; }
+    fs->trace = NULL;
+    free(fs->dh_disp); fs->dh_disp = NULL;
+    free(fs->meta); fs->meta = NULL; fs->meta_blocks = 0;
+    free(fs->pc); fs->pc = NULL;
+    pthread_mutex_destroy(&fs->pc_mu);
+    fs->dev.close(&fs->dev);
+    return rc;
+}
+
+// ino is 1-based, as in dirents
+static int fs_inode(fs_t* fs, uint32_t ino, inode_t* out){
+    if(ino == 0 || ino > fs->sb.inode_count){ fprintf(stderr,"Bad inode number %u\n", ino); return -1; }
+    uint32_t idx = ino - 1;
+    uint8_t blk[BS];
+    if(fs_read(fs, fs->sb.inode_table_start + idx / (BS/INODE_SIZE), blk, ino, OP_ITABLE) != 0) return -1;
+    memcpy(out, blk + (idx % (BS/INODE_SIZE)) * INODE_SIZE, sizeof(*out));
+    if(!inode_crc_ok(out)){ fprintf(stderr,"Inode #%u checksum mismatch\n", ino); return -1; }
+    return 0;
+}
+
+// Calls fn for each live, checksummed entry of the root directory; stops when fn returns non-zero
+typedef int (*dirent_fn)(fs_t* fs, const dirent64_t* de, void* arg);
+static int fs_readdir(fs_t* fs, dirent_fn fn, void* arg){
+    inode_t root;
+    if(fs_inode(fs, (uint32_t)fs->sb.root_inode, &root) != 0) return -1;
+    uint8_t blk[BS];
+    uint64_t left = root.size_bytes / sizeof(dirent64_t);
+    for(int d=0; d<DIRECT_MAX && left; d++){
+        if(!root.direct[d]) continue;
+        if(fs_read(fs, root.direct[d], blk, (uint32_t)fs->sb.root_inode, OP_DIR) != 0) return -1;
+        const dirent64_t* de = (const dirent64_t*)blk;
+        for(uint32_t s=0; s<BS/sizeof(dirent64_t) && left; s++){
+            if(!de[s].inode_no) continue;
+            left--;
+            if(!dirent_checksum_ok(&de[s])){ fprintf(stderr,"Skipping dirent with bad checksum\n"); continue; }
+            int r = fn(fs, &de[s], arg);
+            if(r) return r;
+        }
+    }
+    return 0;
+}
+
+// Entry idx of pointer block blk, through the cache
+static int fs_ptr(fs_t* fs, uint64_t blk, uint32_t idx, uint32_t ino, uint32_t* out){
+    if(blk < fs->sb.data_region_start || blk >= fs->sb.data_region_start + fs->sb.data_region_blocks){
+        fprintf(stderr,"Inode #%u: pointer block %" PRIu64 " outside the data region\n", ino, blk); return -1;
+    }
+    int rc = 0;
+    pthread_mutex_lock(&fs->pc_mu);
+    if(!fs->pc) fs->pc = (pcache_ent_t*)calloc(PCACHE_SLOTS, sizeof(*fs->pc));
+    if(!fs->pc){
+        uint32_t tmp[PTRS_PER_BLK];   // no cache: read it every time
+        rc = fs_read(fs, blk, tmp, ino, OP_PTR);
+        if(!rc) *out = tmp[idx];
+    } else {
+        pcache_ent_t* e = &fs->pc[blk % PCACHE_SLOTS];
+        if(e->blk != blk){
+            rc = fs_read(fs, blk, e->ptr, ino, OP_PTR);
+            e->blk = rc ? 0 : blk;
+        }
+        if(!rc) *out = e->ptr[idx];
+    }
+    pthread_mutex_unlock(&fs->pc_mu);
+    return rc;
+}
+
+// Image block holding file block k (0 for a hole)
+static int fs_bmap(fs_t* fs, const inode_t* in, uint32_t ino, uint64_t k, uint32_t* out){
+    if(k < DIRECT_MAX){ *out = in->direct[k]; return 0; }
+    if(!(fs->sb.flags & SB_FLAG_INDIRECT) || (in->mode & 0170000) != 0100000 ||
+       k >= DIRECT_MAX + PTRS_PER_BLK + (uint64_t)PTRS_PER_BLK * PTRS_PER_BLK){
+        fprintf(stderr,"Inode #%u: size beyond its block map\n", ino); return -1;
+    }
+    k -= DIRECT_MAX;
+    if(k < PTRS_PER_BLK){
+        if(!in->reserved_0){ *out = 0; return 0; }
+        return fs_ptr(fs, in->reserved_0, (uint32_t)k, ino, out);
+    }
+    k -= PTRS_PER_BLK;
+    uint32_t l2;
+    if(!in->reserved_1){ *out = 0; return 0; }
+    if(fs_ptr(fs, in->reserved_1, (uint32_t)(k / PTRS_PER_BLK), ino, &l2) != 0) return -1;
+    if(!l2){ *out = 0; return 0; }
+    return fs_ptr(fs, l2, (uint32_t)(k % PTRS_PER_BLK), ino, out);
+}
+
+// Streams bytes [off, off+len) of a file to out, clipped to its size
+static int fs_cat_ino(fs_t* fs, uint32_t ino, uint64_t off, uint64_t len, FILE* out){
+    inode_t in;
+    if(fs_inode(fs, ino, &in) != 0) return -1;
+    if(off >= in.size_bytes) return 0;
+    if(len > in.size_bytes - off) len = in.size_bytes - off;
+    uint8_t blk[BS];
+    for(uint64_t pos = off, end = off + len; pos < end; ){
+        uint32_t at = (uint32_t)(pos % BS), b;
+        uint32_t n = end - pos < BS - at ? (uint32_t)(end - pos) : BS - at;
+        if(fs_bmap(fs, &in, ino, pos / BS, &b) != 0) return -1;
+        if(!b) memset(blk, 0, BS);
+        else if(fs_read(fs, b, blk, ino, OP_DATA) != 0) return -1;
+        if(fwrite(blk + at, 1, n, out) != n){ perror("write"); return -1; }
+        pos += n;
+    }
+    return 0;
+}
+
+typedef struct { const char* name; uint32_t ino; } find_t;
+static int find_fn(fs_t* fs, const dirent64_t* de, void* arg){
+    (void)fs;
+    find_t* f = (find_t*)arg;
+    size_t n = strlen(f->name);
+    if(n > sizeof(de->name) || memcmp(de->name, f->name, n) || (n < sizeof(de->name) && de->name[n])) return 0;
+    f->ino = de->inode_no;
+    return 1;
+}
+// Loads the header and displacements once; the slots stay on disk
+static int dirhash_load(fs_t* fs){
+    if(fs->dh_state) return fs->dh_state;
+    fs->dh_state = -1;
+    inode_t root;
+    if(fs_inode(fs, (uint32_t)fs->sb.root_inode, &root) != 0) return -1;
+    fs->dh_start = root.reserved_0; fs->dh_blocks = root.reserved_1;
+    if(fs->dh_start < fs->sb.data_region_start || !fs->dh_blocks ||
+       fs->dh_start + fs->dh_blocks > fs->sb.data_region_start + fs->sb.data_region_blocks) goto bad;
+    uint8_t blk[BS];
+    if(fs_read(fs, fs->dh_start, blk, (uint32_t)fs->sb.root_inode, OP_HASH) != 0) goto bad;
+    memcpy(&fs->dh, blk, sizeof(fs->dh));
+    const dirhash_hdr_t* h = &fs->dh;
+    if(h->magic != DIRHASH_MAGIC || !h->nkeys || !h->nbuckets ||
+       h->slots_off < sizeof(*h) + (uint64_t)h->nbuckets * 4 ||
+       h->slots_off + (uint64_t)h->nkeys * sizeof(dirent64_t) > fs->dh_blocks * BS) goto bad;
+    fs->dh_disp = (uint32_t*)malloc((size_t)h->nbuckets * 4);
+    if(!fs->dh_disp) goto bad;
+    // disp[] usually fits in the first block; read on if not
+    uint64_t have = BS - sizeof(*h), want = (uint64_t)h->nbuckets * 4;
+    memcpy(fs->dh_disp, blk + sizeof(*h), want < have ? want : have);
+    for(uint64_t b=1; have < want; b++, have += BS){
+        if(fs_read(fs, fs->dh_start + b, blk, (uint32_t)fs->sb.root_inode, OP_HASH) != 0) goto bad;
+        memcpy((uint8_t*)fs->dh_disp + have, blk, want - have < BS ? want - have : BS);
+    }
+    if(crc32(fs->dh_disp, want) != h->disp_crc) goto bad;
+    return fs->dh_state = 1;
+bad:
+    fprintf(stderr,"Finalized image has a bad name table; falling back to a directory scan\n");
+    free(fs->dh_disp); fs->dh_disp = NULL;
+    return -1;
+}
+
+// One hash, one probe: the slot holds the only name that can hash there
+static uint32_t dirhash_lookup(fs_t* fs, const char* name){
+    size_t n = strlen(name);
+    if(n > sizeof(((dirent64_t*)0)->name)) return 0;
+    const dirhash_hdr_t* h = &fs->dh;
+    uint32_t b = (uint32_t)(dirhash(name, n, 0) % h->nbuckets);
+    uint32_t s = (uint32_t)(dirhash(name, n, fs->dh_disp[b]) % h->nkeys);
+    uint64_t off = h->slots_off + (uint64_t)s * sizeof(dirent64_t);
+    uint8_t blk[BS];
+    if(fs_read(fs, fs->dh_start + off / BS, blk, (uint32_t)fs->sb.root_inode, OP_HASH) != 0) return 0;
+    const dirent64_t* de = (const dirent64_t*)(blk + off % BS);
+    find_t f = { name, 0 };
+    if(!dirent_checksum_ok(de) || !find_fn(fs, de, &f)) return 0;
+    return f.ino;
+}
+
+static uint32_t fs_lookup(fs_t* fs, const char* name){
+    if((fs->sb.flags & SB_FLAG_DIRHASH) && dirhash_load(fs) == 1) return dirhash_lookup(fs, name);
+    find_t f = { name, 0 };
+    return fs_readdir(fs, find_fn, &f) == 1 ? f.ino : 0;
+}
+
+// arg: NULL for a single image, else the shard number, printed first (. and .. are left out)
+static int ls_fn(fs_t* fs, const dirent64_t* de, void* arg){
+    const uint32_t* shard = (const uint32_t*)arg;
+    if(shard && de->type == 2) return 0;
+    inode_t in;
+    if(fs_inode(fs, de->inode_no, &in) != 0) return -1;
+    if(shard) printf("%3u ", *shard);
+    printf("%6u %c %8" PRIu64 " %.58s\n", de->inode_no, de->type == 2 ? 'd' : '-', in.size_bytes, de->name);
+    return 0;
+}
+
+static int extract_fn(fs_t* fs, const dirent64_t* de, void* arg){
+    const char* dir = (const char*)arg;
+    char name[59]; memcpy(name, de->name, 58); name[58] = '\0';
+    if(de->type == 2 || !name[0] || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) return 0;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* out = fopen(path, "wb");
+    if(!out){ perror(path); return -1; }
+    int rc = fs_cat_ino(fs, de->inode_no, 0, UINT64_MAX, out);
+    if(fclose(out) != 0 && !rc){ perror(path); rc = -1; }
+    return rc;
+}
+
+//  --extract --jobs N: the file list is read first, then N threads pull
+//  files off it; only for devices that can be read concurrently
+
+typedef struct {
+    fs_t*        fs;
+    const char*  dir;
+    dirent64_t*  des;
+    uint32_t     n, cap;
+    atomic_uint  next;
+    atomic_int   failed;
+} extract_pool_t;
+
+static int collect_fn(fs_t* fs, const dirent64_t* de, void* arg){
+    (void)fs;
+    extract_pool_t* p = (extract_pool_t*)arg;
+    if(p->n == p->cap){
+        uint32_t cap = p->cap ? p->cap * 2 : 64;
+        dirent64_t* des = (dirent64_t*)realloc(p->des, cap * sizeof(*des));
+        if(!des){ perror("realloc"); return -1; }
+        p->des = des; p->cap = cap;
+    }
+    p->des[p->n++] = *de;
+    return 0;
+}
+
+static void* extract_worker(void* arg){
+    extract_pool_t* p = (extract_pool_t*)arg;
+    for(;;){
+        uint32_t i = atomic_fetch_add(&p->next, 1);
+        if(i >= p->n || atomic_load(&p->failed)) return NULL;
+        if(extract_fn(p->fs, &p->des[i], (void*)p->dir) != 0) atomic_store(&p->failed, 1);
+    }
+}
+
+static int extract_parallel(fs_t* fs, const char* dir, uint32_t jobs){
+    extract_pool_t p; memset(&p, 0, sizeof(p));
+    p.fs = fs; p.dir = dir;
+    if(fs_readdir(fs, collect_fn, &p) != 0){ free(p.des); return -1; }
+    pthread_t th[64];
+    uint32_t started = 0;
+    for(; started < jobs; started++)
+        if(pthread_create(&th[started], NULL, extract_worker, &p) != 0) break;
+    if(!started) extract_worker(&p);
+    for(uint32_t t=0; t<started; t++) pthread_join(th[t], NULL);
+    free(p.des);
+    return atomic_load(&p.failed) ? -1 : 0;
+}
+
+//  Shard maps (mkfs_builder --shards): a text file naming N images next to
+//  it. A name lives in shard FNV-1a(on-disk name) % N, so lookups open one
+//  shard; listing and extraction walk them all.
+
+#define MAX_SHARDS 64
+
+static uint32_t shard_of(const char* name, size_t len, uint32_t n){
+    uint32_t h = 2166136261u;
+    for(size_t i=0;i<len && name[i];i++){ h ^= (uint8_t)name[i]; h *= 16777619u; }
+    return h % n;
+}
+
+// Returns the number of shards, 0 if path is not a shard map, -1 if it is a bad one
+static int shard_map_read(const char* path, char (*paths)[4096]){
+    FILE* f = fopen(path, "r");
+    if(!f) return 0;
+    char line[4096];
+    unsigned ver = 0, n = 0;
+    if(!fgets(line, sizeof(line), f) || sscanf(line, "mvsfs-shards %u count %u", &ver, &n) != 2){ fclose(f); return 0; }
+    if(ver != 1 || n < 1 || n > MAX_SHARDS){ fprintf(stderr,"Bad shard map\n"); fclose(f); return -1; }
+    const char* slash = strrchr(path, '/');
+    for(unsigned i=0;i<n;i++){
+        if(!fgets(line, sizeof(line), f)){ fprintf(stderr,"Shard map lists fewer than %u images\n", n); fclose(f); return -1; }
+        line[strcspn(line, "\r\n")] = 0;
+        if(line[0] == '/' || !slash) snprintf(paths[i], 4096, "%s", line);
+        else snprintf(paths[i], 4096, "%.*s/%.4000s", (int)(slash - path), path, line);
+    }
+    fclose(f);
+    return (int)n;
+}
+
+//  --replay: re-issue a recorded trace against an image (any layout bdev_t can read)
+
+static int replay(fs_t* fs, const char* path, int paced){
+    FILE* f = fopen(path, "rb");
+    if(!f){ perror("fopen replay"); return 1; }
+    uint32_t hdr[2];
+    if(fread(hdr, sizeof(hdr), 1, f) != 1 || hdr[0] != TRACE_MAGIC || hdr[1] != TRACE_VERSION){
+        fprintf(stderr,"Not a block trace: %s\n", path); fclose(f); return 1;
+    }
+    uint8_t blk[BS];
+    trace_rec_t r;
+    uint64_t n = 0, skipped = 0, errors = 0;
+    double t0 = now_ns();
+    while(fread(&r, sizeof(r), 1, f) == 1){
+        if(r.block >= fs->dev.total_blocks || r.op >= OP_COUNT){ skipped++; continue; }
+        if(paced){
+            double wait = (double)r.ts_ns - (now_ns() - t0);
+            if(wait > 0){
+                struct timespec ts = { (time_t)(wait / 1e9), (long)((uint64_t)wait % 1000000000u) };
+                nanosleep(&ts, NULL);
+            }
+        }
+        if(fs->dev.read(&fs->dev, r.block, blk) != 0) errors++;
+        fs->reads[r.op]++;
+        n++;
+    }
+    double ms = (now_ns() - t0) / 1e6;
+    fclose(f);
+    fprintf(stderr,"replayed %" PRIu64 " block reads in %.3f ms (%.1f MB/s), %" PRIu64 " skipped, %" PRIu64 " errors\n",
+            n, ms, ms > 0 ? (double)n * BS / 1e6 / (ms / 1e3) : 0.0, skipped, errors);
+    fprintf(stderr,"replayed by op:");
+    for(int i=0;i<OP_COUNT;i++) fprintf(stderr," %s=%" PRIu64, OP_NAMES[i], fs->reads[i]);
+    fprintf(stderr,"\n");
+    return errors ? 1 : 0;
+}
+
+typedef struct {
+    const char* image;
+    int         ls;
+    const char* cat[MAX_CAT];
+    int         ncat;
+    const char* extract;
+    const char* trace;     // --trace-blocks output
+    const char* replay;
+    int         paced;     // --replay keeps the recorded timing
+    int         lazy;      // fetch blocks on first touch (userfaultfd)
+    uint32_t    jobs;      // --extract threads
+    uint64_t    off, len;  // --range applied to every --cat
+} cli_t;
+
+static int parse_cli(int argc, char** argv, cli_t* c){
+    memset(c, 0, sizeof(*c));
+    c->len = UINT64_MAX;
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"--image") && i+1<argc) c->image = argv[++i];
+        else if(!strcmp(argv[i],"--ls")) c->ls = 1;
+        else if(!strcmp(argv[i],"--range") && i+1<argc){
+            char* end;
+            c->off = strtoull(argv[++i], &end, 10);
+            if(*end == ':') c->len = strtoull(end + 1, &end, 10);
+            if(*end){ fprintf(stderr,"--range must be <offset>[:<length>]\n"); return -1; }
+        }
+        else if(!strcmp(argv[i],"--cat") && i+1<argc && c->ncat < MAX_CAT) c->cat[c->ncat++] = argv[++i];
+        else if(!strcmp(argv[i],"--extract") && i+1<argc) c->extract = argv[++i];
+        else if(!strcmp(argv[i],"--trace-blocks") && i+1<argc) c->trace = argv[++i];
+        else if(!strcmp(argv[i],"--replay") && i+1<argc) c->replay = argv[++i];
+        else if(!strcmp(argv[i],"--paced")) c->paced = 1;
+        else if(!strcmp(argv[i],"--lazy")) c->lazy = 1;
+        else if(!strcmp(argv[i],"--jobs") && i+1<argc) c->jobs = (uint32_t)strtoul(argv[++i],NULL,10);
+        else { fprintf(stderr,"Unknown/invalid arg: %s\n", argv[i]); return -1; }
+    }
+    if(!c->image || (!c->ls && !c->ncat && !c->extract && !c->replay)){
+        fprintf(stderr,"Usage: --image <img> (--ls | --cat <name>... | --extract <dir> | --replay <trace> [--paced])"
+                       " [--range <off>[:<len>]] [--trace-blocks <file>] [--lazy] [--jobs <n>]\n");
+        return -1;
+    }
+    if(c->jobs > 64){ fprintf(stderr,"--jobs must be in [1..64]\n"); return -1; }
+    return 0;
+}
+
+int main(int argc, char** argv){
+    crc32_init();
+    cli_t cli; if(parse_cli(argc, argv, &cli)!=0) return 2;
+    static char paths[MAX_SHARDS][4096];
+    static fs_t fss[MAX_SHARDS];
+    int nshards = shard_map_read(cli.image, paths);
+    if(nshards < 0) return 1;
+    if(nshards && (cli.trace || cli.replay)){
+        fprintf(stderr,"--trace-blocks/--replay take one image; pass a shard file, not the shard map\n"); return 2;
+    }
+    uint32_t n = nshards ? (uint32_t)nshards : 1;
+    if(!nshards) snprintf(paths[0], sizeof(paths[0]), "%s", cli.image);
+    for(uint32_t i=0;i<n;i++){
+        if(bdev_open(paths[i], &fss[i].dev) != 0){
+            while(i--) fss[i].dev.close(&fss[i].dev);
+            return 1;
+        }
+        if(cli.lazy) lazy_open(&fss[i].dev);
+    }
+    fs_t* fs = &fss[0];
+
+    if(cli.replay){
+        int rc = replay(fs, cli.replay, cli.paced);
+        fs->dev.close(&fs->dev);
+        return rc;
+    }
+
+    int rc = 0;
+    uint32_t mounted = 0;
+    for(; mounted<n; mounted++){
+        if(fs_mount(&fss[mounted], cli.trace) != 0){ rc = 3; mounted++; break; }
+    }
+    for(uint32_t i=0; i<n && cli.ls && !rc; i++)
+        if(fs_readdir(&fss[i], ls_fn, nshards ? &i : NULL) != 0) rc = 1;
+    for(int i=0; i<cli.ncat && !rc; i++){
+        fs_t* sh = &fss[nshards ? shard_of(cli.cat[i], strnlen(cli.cat[i], 58), n) : 0];
+        uint32_t ino = fs_lookup(sh, cli.cat[i]);
+        if(!ino){ fprintf(stderr,"No such file: %s\n", cli.cat[i]); rc = 4; break; }
+        if(fs_cat_ino(sh, ino, cli.off, cli.len, stdout) != 0) rc = 1;
+    }
+    if(!rc && cli.extract){
+        if(mkdir(cli.extract, 0755) != 0 && errno != EEXIST){ perror("mkdir --extract"); rc = 1; }
+        for(uint32_t i=0; i<n && !rc; i++){
+            fs = &fss[i];
+            if(cli.jobs > 1 && !fs->dev.mt_safe){
+                fprintf(stderr,"--jobs: this image layout is read by one thread, extracting serially\n");
+                if(fs_readdir(fs, extract_fn, (void*)cli.extract) != 0) rc = 1;
+            }
+            else if(cli.jobs > 1){ if(extract_parallel(fs, cli.extract, cli.jobs) != 0) rc = 1; }
+            else if(fs_readdir(fs, extract_fn, (void*)cli.extract) != 0) rc = 1;
+        }
+    }
+    if(fflush(stdout) != 0) rc = 1;
+    for(uint32_t i=0;i<n;i++){
+        if(i < mounted){ if(fs_unmount(&fss[i]) != 0 && !rc) rc = 1; }
+        else fss[i].dev.close(&fss[i].dev);
+    }
+    return rc;
+}
@@ -0,0 +1,303 @@
+// vsfs_compact.c - renumber the inodes of a MiniVSFS image so the live ones are packed
+// build: gcc -O2 -std=c17 -Wall -Wextra vsfs_compact.c -o vsfs_compact
+// run:   ./vsfs_compact --input fs.img --output fs.compact.img [--order dir|size|ino]
+//
+// Live inodes (set in the inode bitmap) are moved to the lowest inode numbers,
+// root staying #1, so scans of the inode table touch as few blocks as
+// possible. Every dirent is rewritten to the new numbers with a fresh
+// checksum, and the inode bitmap becomes one run of set bits. Moved inodes
+// are copied whole: their CRCs cover contents only and stay valid. Dirents
+// that name a free inode are removed, since that number may be reused.
+//   --order dir   directory order: files as `/` lists them (default)
+//           size  smallest files first
+//           ino   keep the current relative order
+// Data blocks are not moved. Finalized images are refused (their name table
+// holds inode numbers too); compact the image they were made from.
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define DIRECT_MAX 12
+
+#pragma pack(push, 1)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must be 116 bytes");
+
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[DIRECT_MAX];
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode must be 128 bytes");
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t inode_no;
+    uint8_t  type;
+    char     name[58];
+    uint8_t  checksum;
+} dirent64_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t) == 64, "dirent must be 64 bytes");
+
+#define SB_FLAG_DIRHASH 0x1u    // finalized by vsfs_finalize: read-only
+#define DIR_MODE  0040000
+#define MODE_MASK 0170000
+
+// - helpers (from skeleton given temp)
+
+static uint32_t CRC32_TAB[256];
+static void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        CRC32_TAB[i]=c;
+    }
+}
+static uint32_t crc32(const void* data, size_t n){
+    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+static void inode_crc_finalize(inode_t* ino){
+    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
+    memset(&tmp[120], 0, 8);
+    uint32_t c = crc32(tmp, 120);
+    ino->inode_crc = (uint64_t)c;
+}
+
+static void dirent_checksum_finalize(dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];
+    de->checksum = x;
+}
+static inline int test_bit(const uint8_t* bmap, uint32_t idx){
+    return (bmap[idx >> 3] >> (idx & 7)) & 1u;
+}
+static inline void set_bit(uint8_t* bmap, uint32_t idx){
+    bmap[idx >> 3] |= (uint8_t)(1u << (idx & 7));
+}
+
+enum { ORDER_DIR, ORDER_SIZE, ORDER_INO };
+
+typedef struct { const char* in_img; const char* out_img; int order; } cli_t;
+
+static int parse_cli(int argc, char** argv, cli_t* c){
+    memset(c, 0, sizeof(*c));
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"--input") && i+1<argc) c->in_img = argv[++i];
+        else if(!strcmp(argv[i],"--output") && i+1<argc) c->out_img = argv[++i];
+        else if(!strcmp(argv[i],"--order") && i+1<argc){
+            const char* o = argv[++i];
+            if(!strcmp(o,"dir")) c->order = ORDER_DIR;
+            else if(!strcmp(o,"size")) c->order = ORDER_SIZE;
+            else if(!strcmp(o,"ino")) c->order = ORDER_INO;
+            else { fprintf(stderr,"--order must be dir, size or ino\n"); return -1; }
+        }
+        else { fprintf(stderr,"Unknown/invalid arg: %s\n", argv[i]); return -1; }
+    }
+    if(!c->in_img || !c->out_img){
+        fprintf(stderr,"Usage: --input <img> --output <img> [--order dir|size|ino]\n");
+        return -1;
+    }
+    return 0;
+}
+
+static const inode_t* size_itbl;    // for the qsort comparator
+static int by_size(const void* a, const void* b){
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    uint64_t sx = size_itbl[x].size_bytes, sy = size_itbl[y].size_bytes;
+    if(sx != sy) return (sx > sy) - (sx < sy);
+    return (x > y) - (x < y);
+}
+
+static uint32_t blocks_touched(const uint8_t* inode_bmap, uint32_t count){
+    const uint32_t per_blk = BS / INODE_SIZE;
+    uint32_t n = 0;
+    for(uint32_t b=0; b*per_blk < count; b++){
+        for(uint32_t i=b*per_blk; i<(b+1)*per_blk && i<count; i++) if(test_bit(inode_bmap, i)){ n++; break; }
+    }
+    return n;
+}
+
+int main(int argc, char** argv){
+    crc32_init();
+    cli_t cli; if(parse_cli(argc, argv, &cli)!=0) return 2;
+
+    FILE* fi = fopen(cli.in_img, "rb");
+    if(!fi){ perror("fopen input"); return 1; }
+    if(fseek(fi, 0, SEEK_END) != 0){ perror("fseek"); fclose(fi); return 1; }
+    long sz = ftell(fi);
+    rewind(fi);
+    if(sz <= 0 || sz % BS){ fprintf(stderr,"Invalid image (size not multiple of block size)\n"); fclose(fi); return 1; }
+    uint8_t* img = (uint8_t*)malloc((size_t)sz);
+    if(!img){ fclose(fi); return 1; }
+    size_t got = fread(img, 1, (size_t)sz, fi);
+    fclose(fi);
+    if(got != (size_t)sz){ fprintf(stderr,"Short read on input image\n"); free(img); return 1; }
+
+    const uint64_t total_blocks = (uint64_t)sz / BS;
+    superblock_t* sb = (superblock_t*)img;
+    if(sb->magic != 0x4D565346u || sb->version != 1 || sb->block_size != BS || sb->total_blocks != total_blocks){
+        fprintf(stderr,"Not a MiniVSFS image\n"); free(img); return 3;
+    }
+    if(sb->flags & SB_FLAG_DIRHASH){
+        fprintf(stderr,"Image is finalized (read-only); compact the image it was made from\n"); free(img); return 3;
+    }
+    // root always ends up as #1; the superblock is not rewritten
+    if(sb->root_inode != 1){
+        fprintf(stderr,"Root is inode #%" PRIu64 ", not #1; not compacting\n", sb->root_inode); free(img); return 3;
+    }
+    const uint32_t count = (uint32_t)sb->inode_count;
+    const uint32_t root_idx = (uint32_t)sb->root_inode - 1;
+    if(root_idx >= count || sb->inode_table_blocks * (BS/INODE_SIZE) < count){
+        fprintf(stderr,"Bad inode table geometry\n"); free(img); return 3;
+    }
+    uint8_t* inode_bmap = img + BS * sb->inode_bitmap_start;
+    inode_t* itbl       = (inode_t*)(img + BS * sb->inode_table_start);
+
+    // order[] lists old indexes in their new order; map[] is old index -> new index
+    uint32_t* order = (uint32_t*)malloc(count * sizeof(*order));
+    uint32_t* map   = (uint32_t*)malloc(count * sizeof(*map));
+    inode_t*  ntbl  = (inode_t*)calloc(count, sizeof(*ntbl));
+    if(!order || !map || !ntbl){ free(ntbl); free(map); free(order); free(img); return 1; }
+    for(uint32_t i=0;i<count;i++) map[i] = UINT32_MAX;
+    uint32_t n = 0;
+    order[n] = root_idx; map[root_idx] = n++;
+
+    if(cli.order == ORDER_DIR){
+        // walk directories breadth-first from /, taking each inode the first time a dirent names it
+        for(uint32_t q=0; q<n; q++){
+            const inode_t* d = &itbl[order[q]];
+            if((d->mode & MODE_MASK) != DIR_MODE) continue;
+            for(int k=0;k<DIRECT_MAX;k++){
+                if(!d->direct[k] || d->direct[k] >= total_blocks) continue;
+                const dirent64_t* de = (const dirent64_t*)(img + BS * (uint64_t)d->direct[k]);
+                for(uint32_t s=0;s<BS/sizeof(dirent64_t);s++){
+                    uint32_t o = de[s].inode_no - 1;
+                    if(!de[s].inode_no || o >= count || map[o] != UINT32_MAX || !test_bit(inode_bmap, o)) continue;
+                    order[n] = o; map[o] = n++;
+                }
+            }
+        }
+    }
+    // the rest (everything for size/ino, unreachable inodes for dir) by old number
+    uint32_t first_rest = n;
+    for(uint32_t i=0;i<count;i++){
+        if(map[i] != UINT32_MAX || !test_bit(inode_bmap, i)) continue;
+        order[n] = i; map[i] = n++;
+    }
+    if(cli.order == ORDER_SIZE){
+        size_itbl = itbl;
+        qsort(order + first_rest, n - first_rest, sizeof(*order), by_size);
+        for(uint32_t j=first_rest;j<n;j++) map[order[j]] = j;
+    }
+    if(cli.order == ORDER_DIR && n > first_rest)
+        fprintf(stderr,"%u live inodes are not in any directory; placed last\n", n - first_rest);
+
+    uint32_t before = blocks_touched(inode_bmap, count), moved = 0;
+    for(uint32_t j=0;j<n;j++){
+        ntbl[j] = itbl[order[j]];
+        moved += order[j] != j;
+    }
+
+    // rewrite dirents of every directory (now in ntbl) to the new numbers.
+    // A dirent naming a free inode is dropped: its old number may belong to
+    // another live inode after the move.
+    uint32_t dangling = 0;
+    for(uint32_t j=0;j<n;j++){
+        inode_t* d = &ntbl[j];
+        if((d->mode & MODE_MASK) != DIR_MODE) continue;
+        uint32_t dropped = 0;
+        for(int k=0;k<DIRECT_MAX;k++){
+            if(!d->direct[k] || d->direct[k] >= total_blocks) continue;
+            dirent64_t* de = (dirent64_t*)(img + BS * (uint64_t)d->direct[k]);
+            for(uint32_t s=0;s<BS/sizeof(dirent64_t);s++){
+                if(!de[s].inode_no) continue;
+                uint32_t o = de[s].inode_no - 1;
+                if(o >= count || map[o] == UINT32_MAX){
+                    if(de[s].type == 1 && d->links > 2) d->links--;   // files add one link, as in mkfs_adder
+                    memset(&de[s], 0, sizeof(de[s]));
+                    dropped++;
+                    continue;
+                }
+                if(map[o] == o) continue;
+                de[s].inode_no = map[o] + 1;
+                dirent_checksum_finalize(&de[s]);
+            }
+        }
+        if(dropped){
+            uint64_t gone = (uint64_t)dropped * sizeof(dirent64_t);
+            d->size_bytes = d->size_bytes > gone ? d->size_bytes - gone : 0;
+            inode_crc_finalize(d);
+            dangling += dropped;
+        }
+    }
+    if(dangling) fprintf(stderr,"%u dirents named free inodes; removed\n", dangling);
+
+    memcpy(itbl, ntbl, count * sizeof(*ntbl));
+    memset(inode_bmap, 0, BS * sb->inode_bitmap_blocks);
+    for(uint32_t j=0;j<n;j++) set_bit(inode_bmap, j);
+    uint32_t after = blocks_touched(inode_bmap, count);
+
+    FILE* fo = fopen(cli.out_img, "wb");
+    if(!fo){ perror("fopen output"); free(ntbl); free(map); free(order); free(img); return 1; }
+    size_t wrote = fwrite(img, BS, (size_t)total_blocks, fo);
+    int cerr = fclose(fo);
+    free(ntbl); free(map); free(order); free(img);
+    if(wrote != total_blocks || cerr != 0){ fprintf(stderr,"Short write on output image\n"); return 1; }
+    fprintf(stdout,"Compacted '%s' -> '%s': %u live inodes, %u moved, inode table blocks in use %u -> %u\n",
+            cli.in_img, cli.out_img, n, moved, before, after);
+    return 0;
+}
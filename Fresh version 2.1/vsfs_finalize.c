@@ -0,0 +1,329 @@
+// vsfs_finalize.c - seal a MiniVSFS image read-only with a perfect-hash name table
+// build: gcc -O2 -std=c17 -Wall -Wextra vsfs_finalize.c -o vsfs_finalize
+// run:   ./vsfs_finalize --input fs.img --output fs.sealed.img
+//
+// Builds a minimal perfect hash (hash-and-displace) over every entry of `/`
+// and stores it in one contiguous run of data blocks:
+//   dirhash_hdr_t | disp[nbuckets] (u32) | pad to 64 B | slots[nkeys] (dirent64_t)
+// bucket = H(name, 0) % nbuckets, slot = H(name, disp[bucket]) % nkeys, and
+// slots[slot] is a copy of the name's dirent, so a lookup is one hash and
+// one probe. The run is found through the root inode (reserved_0 = first
+// block, reserved_1 = block count) and SB_FLAG_DIRHASH in the superblock.
+// mkfs_adder refuses sealed images; vsfs_cat uses the table for --cat.
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define DIRECT_MAX 12
+
+#pragma pack(push, 1)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must be 116 bytes");
+
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[DIRECT_MAX];
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode must be 128 bytes");
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t inode_no;
+    uint8_t  type;
+    char     name[58];
+    uint8_t  checksum;
+} dirent64_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t) == 64, "dirent must be 64 bytes");
+
+//  Perfect-hash directory table (same definitions in vsfs_cat.c)
+
+#define SB_FLAG_DIRHASH 0x1u        // sealed: root has a dirhash table, image is read-only
+#define DIRHASH_MAGIC   0x4853564Du // "MVSH"
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t nkeys;
+    uint32_t nbuckets;
+    uint32_t slots_off;     // byte offset of slots[] from the start of the run
+    uint32_t disp_crc;      // crc32 of disp[]
+    uint32_t pad[3];
+} dirhash_hdr_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirhash_hdr_t) == 32, "dirhash header must be 32 bytes");
+
+// FNV-1a over the seed then the name, with a final avalanche
+static uint64_t dirhash(const char* name, size_t len, uint32_t seed){
+    uint64_t h = 1469598103934665603ull;
+    for(int i=0;i<4;i++){ h ^= (uint8_t)(seed >> (8*i)); h *= 1099511628211ull; }
+    for(size_t i=0;i<len;i++){ h ^= (uint8_t)name[i]; h *= 1099511628211ull; }
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdull; h ^= h >> 33;
+    return h;
+}
+
+// - helpers (from skeleton given temp)
+
+static uint32_t CRC32_TAB[256];
+static void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        CRC32_TAB[i]=c;
+    }
+}
+static uint32_t crc32(const void* data, size_t n){
+    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+static uint32_t superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    uint8_t block[BS]; memset(block, 0, BS);
+    memcpy(block, sb, sizeof(*sb));
+    uint32_t s = crc32(block, BS - 4);
+    sb->checksum = s;
+    return s;
+}
+static void inode_crc_finalize(inode_t* ino){
+    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
+    memset(&tmp[120], 0, 8);
+    uint32_t c = crc32(tmp, 120);
+    ino->inode_crc = (uint64_t)c;
+}
+static inline int test_bit(const uint8_t* bmap, uint32_t idx){
+    return (bmap[idx >> 3] >> (idx & 7)) & 1u;
+}
+static inline void set_bit(uint8_t* bmap, uint32_t idx){
+    bmap[idx >> 3] |= (uint8_t)(1u << (idx & 7));
+}
+
+typedef struct { const dirent64_t* de; size_t len; uint32_t bucket; } name_key_t;
+typedef struct { uint32_t bucket, first, count; } bucket_t;
+
+static int by_bucket(const void* a, const void* b){
+    const name_key_t* x = (const name_key_t*)a; const name_key_t* y = (const name_key_t*)b;
+    return (x->bucket > y->bucket) - (x->bucket < y->bucket);
+}
+static int by_size_desc(const void* a, const void* b){
+    const bucket_t* x = (const bucket_t*)a; const bucket_t* y = (const bucket_t*)b;
+    if(x->count != y->count) return (x->count < y->count) - (x->count > y->count);
+    return (x->bucket > y->bucket) - (x->bucket < y->bucket);
+}
+
+// Hash and displace: place the biggest buckets first, trying displacements
+// until every key of the bucket lands in a distinct free slot.
+// Returns 0 and fills disp[] / slot_of[] (per key), or -1 if no displacement worked.
+static int build_mph(name_key_t* keys, uint32_t n, uint32_t nb, uint32_t* disp, uint32_t* slot_of){
+    for(uint32_t i=0;i<n;i++) keys[i].bucket = (uint32_t)(dirhash(keys[i].de->name, keys[i].len, 0) % nb);
+    qsort(keys, n, sizeof(*keys), by_bucket);
+
+    bucket_t* bk = (bucket_t*)calloc(nb, sizeof(*bk));
+    uint8_t* taken = (uint8_t*)calloc(n, 1);
+    uint32_t* try_slot = (uint32_t*)malloc(n * sizeof(*try_slot));
+    int rc = -1;
+    if(!bk || !taken || !try_slot) goto out;
+    for(uint32_t b=0;b<nb;b++) bk[b].bucket = b;
+    for(uint32_t i=0;i<n;i++){
+        bucket_t* B = &bk[keys[i].bucket];
+        if(!B->count) B->first = i;
+        B->count++;
+    }
+    qsort(bk, nb, sizeof(*bk), by_size_desc);
+
+    for(uint32_t bi=0; bi<nb; bi++){
+        const bucket_t* B = &bk[bi];
+        if(!B->count){ disp[B->bucket] = 1; continue; }
+        uint32_t d;
+        for(d=1; d<(1u<<20); d++){
+            uint32_t k;
+            for(k=0;k<B->count;k++){
+                const name_key_t* K = &keys[B->first + k];
+                uint32_t s = (uint32_t)(dirhash(K->de->name, K->len, d) % n);
+                if(taken[s]) break;
+                uint32_t j;
+                for(j=0;j<k && try_slot[j]!=s;j++);
+                if(j<k) break;
+                try_slot[k] = s;
+            }
+            if(k == B->count) break;
+        }
+        if(d == (1u<<20)) goto out;
+        disp[B->bucket] = d;
+        for(uint32_t k=0;k<B->count;k++){ taken[try_slot[k]] = 1; slot_of[B->first + k] = try_slot[k]; }
+    }
+    rc = 0;
+out:
+    free(try_slot); free(taken); free(bk);
+    return rc;
+}
+
+typedef struct { const char* in_img; const char* out_img; } cli_t;
+
+static int parse_cli(int argc, char** argv, cli_t* c){
+    memset(c, 0, sizeof(*c));
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"--input") && i+1<argc) c->in_img = argv[++i];
+        else if(!strcmp(argv[i],"--output") && i+1<argc) c->out_img = argv[++i];
+        else { fprintf(stderr,"Unknown/invalid arg: %s\n", argv[i]); return -1; }
+    }
+    if(!c->in_img || !c->out_img){
+        fprintf(stderr,"Usage: --input <img> --output <img>\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv){
+    crc32_init();
+    cli_t cli; if(parse_cli(argc, argv, &cli)!=0) return 2;
+
+    FILE* fi = fopen(cli.in_img, "rb");
+    if(!fi){ perror("fopen input"); return 1; }
+    if(fseek(fi, 0, SEEK_END) != 0){ perror("fseek"); fclose(fi); return 1; }
+    long sz = ftell(fi);
+    rewind(fi);
+    if(sz <= 0 || sz % BS){ fprintf(stderr,"Invalid image (size not multiple of block size)\n"); fclose(fi); return 1; }
+    uint8_t* img = (uint8_t*)malloc((size_t)sz);
+    if(!img){ fclose(fi); return 1; }
+    size_t got = fread(img, 1, (size_t)sz, fi);
+    fclose(fi);
+    if(got != (size_t)sz){ fprintf(stderr,"Short read on input image\n"); free(img); return 1; }
+
+    const uint64_t total_blocks = (uint64_t)sz / BS;
+    superblock_t* sb = (superblock_t*)img;
+    if(sb->magic != 0x4D565346u || sb->version != 1 || sb->block_size != BS || sb->total_blocks != total_blocks){
+        fprintf(stderr,"Not a MiniVSFS image\n"); free(img); return 3;
+    }
+    if(sb->flags & SB_FLAG_DIRHASH){ fprintf(stderr,"Image is already finalized\n"); free(img); return 3; }
+
+    uint8_t* data_bmap = img + BS * sb->data_bitmap_start;
+    inode_t* itbl      = (inode_t*)(img + BS * sb->inode_table_start);
+    inode_t* root      = &itbl[sb->root_inode - 1];
+
+    // every live entry of `/`
+    name_key_t* keys = (name_key_t*)malloc(DIRECT_MAX * (BS/sizeof(dirent64_t)) * sizeof(*keys));
+    if(!keys){ free(img); return 1; }
+    uint32_t n = 0;
+    for(int d=0; d<DIRECT_MAX; d++){
+        if(!root->direct[d]) continue;
+        if(root->direct[d] >= total_blocks){ fprintf(stderr,"Root block out of range\n"); free(keys); free(img); return 3; }
+        const dirent64_t* de = (const dirent64_t*)(img + BS * (uint64_t)root->direct[d]);
+        for(uint32_t s=0; s<BS/sizeof(dirent64_t); s++){
+            if(!de[s].inode_no) continue;
+            keys[n].de = &de[s];
+            keys[n].len = strnlen(de[s].name, sizeof(de[s].name));
+            n++;
+        }
+    }
+    for(uint32_t i=0;i<n;i++) for(uint32_t j=i+1;j<n;j++){
+        if(keys[i].len == keys[j].len && !memcmp(keys[i].de->name, keys[j].de->name, keys[i].len)){
+            fprintf(stderr,"Duplicate name in /: %.58s\n", keys[i].de->name); free(keys); free(img); return 3;
+        }
+    }
+
+    // ~2 keys per bucket keeps the displacement search short
+    uint32_t nb = n / 2 + 1;
+    uint32_t* disp = (uint32_t*)calloc(nb, sizeof(*disp));
+    uint32_t* slot_of = (uint32_t*)calloc(n ? n : 1, sizeof(*slot_of));
+    if(!disp || !slot_of || build_mph(keys, n, nb, disp, slot_of) != 0){
+        fprintf(stderr,"Could not build the perfect hash\n");
+        free(slot_of); free(disp); free(keys); free(img); return 1;
+    }
+
+    uint32_t slots_off = (uint32_t)((sizeof(dirhash_hdr_t) + nb * sizeof(uint32_t) + 63) & ~63u);
+    uint64_t table_bytes = slots_off + (uint64_t)n * sizeof(dirent64_t);
+    uint32_t need = (uint32_t)((table_bytes + BS - 1) / BS);
+
+    // first fit contiguous run in the data region
+    uint32_t start = UINT32_MAX, run = 0;
+    for(uint32_t i=0;i<(uint32_t)sb->data_region_blocks;i++){
+        if(test_bit(data_bmap, i)){ run = 0; continue; }
+        if(++run == need){ start = i + 1 - need; break; }
+    }
+    if(start == UINT32_MAX){
+        fprintf(stderr,"No run of %u free data blocks for the name table\n", need);
+        free(slot_of); free(disp); free(keys); free(img); return 6;
+    }
+
+    uint8_t* tbl = img + BS * (sb->data_region_start + start);
+    memset(tbl, 0, (size_t)need * BS);
+    dirhash_hdr_t hdr; memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = DIRHASH_MAGIC;
+    hdr.nkeys = n;
+    hdr.nbuckets = nb;
+    hdr.slots_off = slots_off;
+    hdr.disp_crc = crc32(disp, nb * sizeof(uint32_t));
+    memcpy(tbl, &hdr, sizeof(hdr));
+    memcpy(tbl + sizeof(hdr), disp, nb * sizeof(uint32_t));
+    for(uint32_t i=0;i<n;i++) memcpy(tbl + slots_off + (uint64_t)slot_of[i] * sizeof(dirent64_t), keys[i].de, sizeof(dirent64_t));
+    for(uint32_t i=0;i<need;i++) set_bit(data_bmap, start + i);
+
+    root->reserved_0 = (uint32_t)(sb->data_region_start + start);
+    root->reserved_1 = need;
+    inode_crc_finalize(root);
+    sb->flags |= SB_FLAG_DIRHASH;
+    superblock_crc_finalize(sb);
+
+    const uint64_t first = root->reserved_0;
+    FILE* fo = fopen(cli.out_img, "wb");
+    if(!fo){ perror("fopen output"); free(slot_of); free(disp); free(keys); free(img); return 1; }
+    size_t wrote = fwrite(img, BS, (size_t)total_blocks, fo);
+    int cerr = fclose(fo);
+    free(slot_of); free(disp); free(keys); free(img);
+    if(wrote != total_blocks || cerr != 0){ fprintf(stderr,"Short write on output image\n"); return 1; }
+    fprintf(stdout,"Finalized '%s' -> '%s': %u names, %u buckets, table in blocks %" PRIu64 "..%" PRIu64 "\n",
+            cli.in_img, cli.out_img, n, nb, first, first + need - 1);
+    return 0;
+}
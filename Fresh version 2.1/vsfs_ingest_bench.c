@@ -0,0 +1,263 @@
+// vsfs_ingest_bench.c - end-to-end ingest benchmark for mkfs_builder / mkfs_adder
+// build: gcc -O2 -std=c17 -Wall -Wextra vsfs_ingest_bench.c -o vsfs_ingest_bench
+// run:   ./vsfs_ingest_bench [--dist tiny|4k|maxdirect|mixed]... [--geometry KIB:INODES]...
+//                            [--files N] [--format csv|json] [--builder PATH] [--adder PATH]
+//                            [--workdir DIR] [--seed N] [--keep]
+#define _FILE_OFFSET_BITS 64
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define DIRECT_MAX 12
+#define MAX_FILE (DIRECT_MAX * BS)
+
+static const char* DISTS[] = { "tiny", "4k", "maxdirect", "mixed" };
+enum { NDIST = sizeof(DISTS)/sizeof(DISTS[0]) };
+
+typedef struct { uint32_t size_kib, inodes; } geom_t;
+
+typedef struct {
+    const char* builder;
+    const char* adder;
+    const char* workdir;
+    const char* format;    // "csv" or "json"
+    uint32_t    files;
+    uint64_t    seed;
+    int         keep;      // leave the generated files and images behind
+    int         dist_on[NDIST];
+    geom_t      geoms[16];
+    uint32_t    ngeoms;
+} cli_t;
+
+static int parse_cli(int argc, char** argv, cli_t* c){
+    memset(c, 0, sizeof(*c));
+    c->builder = "./mkfs_builder"; c->adder = "./mkfs_adder";
+    c->format = "csv"; c->files = 64; c->seed = 321;
+    int any_dist = 0;
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"--builder") && i+1<argc) c->builder = argv[++i];
+        else if(!strcmp(argv[i],"--adder") && i+1<argc) c->adder = argv[++i];
+        else if(!strcmp(argv[i],"--workdir") && i+1<argc) c->workdir = argv[++i];
+        else if(!strcmp(argv[i],"--format") && i+1<argc) c->format = argv[++i];
+        else if(!strcmp(argv[i],"--files") && i+1<argc) c->files = (uint32_t)strtoul(argv[++i],NULL,10);
+        else if(!strcmp(argv[i],"--seed") && i+1<argc) c->seed = strtoull(argv[++i],NULL,10);
+        else if(!strcmp(argv[i],"--keep")) c->keep = 1;
+        else if(!strcmp(argv[i],"--dist") && i+1<argc){
+            const char* d = argv[++i];
+            int k; for(k=0;k<NDIST && strcmp(d, DISTS[k]);k++){}
+            if(k==NDIST){ fprintf(stderr,"Unknown --dist %s\n", d); return -1; }
+            c->dist_on[k] = 1; any_dist = 1;
+        }
+        else if(!strcmp(argv[i],"--geometry") && i+1<argc){
+            geom_t g;
+            if(sscanf(argv[++i], "%u:%u", &g.size_kib, &g.inodes)!=2 || c->ngeoms == 16){
+                fprintf(stderr,"--geometry wants KIB:INODES\n"); return -1;
+            }
+            c->geoms[c->ngeoms++] = g;
+        }
+        else { fprintf(stderr,"Unknown/invalid arg: %s\n", argv[i]); return -1; }
+    }
+    if(!any_dist) for(int k=0;k<NDIST;k++) c->dist_on[k] = 1;
+    if(!c->ngeoms){
+        c->geoms[c->ngeoms++] = (geom_t){1024, 128};
+        c->geoms[c->ngeoms++] = (geom_t){4096, 512};
+    }
+    if(strcmp(c->format,"csv") && strcmp(c->format,"json")){
+        fprintf(stderr,"--format must be csv or json\n"); return -1;
+    }
+    if(!c->files){ fprintf(stderr,"--files must be > 0\n"); return -1; }
+    return 0;
+}
+
+static uint64_t rng_state;
+static uint64_t rng(void){
+    rng_state ^= rng_state << 13; rng_state ^= rng_state >> 7; rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static uint32_t pick_size(int dist){
+    switch(dist){
+    case 0: return 1 + (uint32_t)(rng() % 256);          // tiny
+    case 1: return BS;                                    // 4k
+    case 2: return MAX_FILE;                              // maxdirect
+    default: {                                            // mixed
+        uint32_t r = (uint32_t)(rng() % 100);
+        if(r < 50) return 1 + (uint32_t)(rng() % 256);
+        if(r < 80) return 1 + (uint32_t)(rng() % (4*BS));
+        if(r < 90) return BS;
+        return MAX_FILE;
+    }
+    }
+}
+
+// How many blocks the data region of a geometry can give to files
+static uint64_t data_capacity(const geom_t* g, uint32_t nfiles){
+    uint64_t total = (uint64_t)g->size_kib * 1024u / BS;
+    uint64_t itbl = (g->inodes + BS/INODE_SIZE - 1) / (BS/INODE_SIZE);
+    uint64_t dir = (2 + nfiles + BS/64 - 1) / (BS/64);
+    uint64_t meta = 3 + itbl + dir;
+    return total > meta ? total - meta : 0;
+}
+
+typedef struct { char path[2200]; uint32_t size; } gen_file_t;
+
+// Writes up to `want` files of distribution `dist` into dir, stopping early
+// once the next one would not fit the geometry
+static uint32_t gen_files(const char* dir, int dist, uint32_t want, const geom_t* g,
+                          gen_file_t* out, uint64_t* payload){
+    static uint8_t buf[MAX_FILE];
+    uint64_t used = 0;
+    uint32_t n = 0;
+    *payload = 0;
+    for(uint32_t i=0;i<want && n+1 < g->inodes;i++){
+        uint32_t sz = pick_size(dist);
+        uint64_t nb = (sz + BS - 1) / BS;
+        if(used + nb > data_capacity(g, n+1)) break;
+        for(uint32_t b=0;b<sz;b++) buf[b] = (uint8_t)rng();
+        snprintf(out[n].path, sizeof(out[n].path), "%s/f%05u.bin", dir, n);
+        FILE* f = fopen(out[n].path, "wb");
+        if(!f){ perror(out[n].path); return n; }
+        if(fwrite(buf, 1, sz, f)!=sz){ perror(out[n].path); fclose(f); return n; }
+        fclose(f);
+        out[n].size = sz;
+        used += nb; *payload += sz; n++;
+    }
+    return n;
+}
+
+typedef struct { double wall_ms; long peak_rss_kib; int rc; } run_t;
+
+static double now_ms(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// fork/exec argv with stdout silenced; accumulates wall time and peak RSS into r
+static int run_tool(char* const argv[], run_t* r){
+    double t0 = now_ms();
+    pid_t pid = fork();
+    if(pid < 0){ perror("fork"); return -1; }
+    if(pid == 0){
+        int dn = open("/dev/null", O_WRONLY);
+        if(dn >= 0){ dup2(dn, 1); close(dn); }
+        execv(argv[0], argv);
+        perror(argv[0]); _exit(127);
+    }
+    int status; struct rusage ru;
+    if(wait4(pid, &status, 0, &ru) < 0){ perror("wait4"); return -1; }
+    r->wall_ms += now_ms() - t0;
+    if(ru.ru_maxrss > r->peak_rss_kib) r->peak_rss_kib = ru.ru_maxrss;
+    int rc = WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+    if(rc && !r->rc) r->rc = rc;
+    return rc;
+}
+
+typedef struct {
+    const char* mode;
+    const char* dist;
+    geom_t      geom;
+    uint32_t    files;
+    uint64_t    payload;
+    uint64_t    image_bytes_written;
+    run_t       run;
+} row_t;
+
+static void print_row(const cli_t* c, const row_t* r, int first){
+    double s = r->run.wall_ms / 1e3;
+    double fps = s > 0 ? r->files / s : 0;
+    double mbs = s > 0 ? r->payload / s / 1e6 : 0;
+    if(!strcmp(c->format,"csv")){
+        if(first) printf("mode,dist,size_kib,inodes,files,payload_bytes,wall_ms,files_per_s,mb_per_s,image_bytes_written,peak_rss_kib,rc\n");
+        printf("%s,%s,%u,%u,%u,%" PRIu64 ",%.3f,%.1f,%.3f,%" PRIu64 ",%ld,%d\n",
+               r->mode, r->dist, r->geom.size_kib, r->geom.inodes, r->files, r->payload,
+               r->run.wall_ms, fps, mbs, r->image_bytes_written, r->run.peak_rss_kib, r->run.rc);
+    } else {
+        printf("%s  {\"mode\":\"%s\",\"dist\":\"%s\",\"size_kib\":%u,\"inodes\":%u,\"files\":%u,"
+               "\"payload_bytes\":%" PRIu64 ",\"wall_ms\":%.3f,\"files_per_s\":%.1f,\"mb_per_s\":%.3f,"
+               "\"image_bytes_written\":%" PRIu64 ",\"peak_rss_kib\":%ld,\"rc\":%d}",
+               first ? "[\n" : ",\n", r->mode, r->dist, r->geom.size_kib, r->geom.inodes, r->files,
+               r->payload, r->run.wall_ms, fps, mbs, r->image_bytes_written,
+               r->run.peak_rss_kib, r->run.rc);
+    }
+}
+
+int main(int argc, char** argv){
+    cli_t cli; if(parse_cli(argc, argv, &cli)!=0) return 2;
+
+    char workdir[1024];
+    if(cli.workdir) snprintf(workdir, sizeof(workdir), "%s", cli.workdir);
+    else {
+        snprintf(workdir, sizeof(workdir), "/tmp/vsfs_ingest.XXXXXX");
+        if(!mkdtemp(workdir)){ perror("mkdtemp"); return 1; }
+    }
+
+    gen_file_t* files = (gen_file_t*)calloc(cli.files, sizeof(gen_file_t));
+    if(!files){ perror("calloc"); return 1; }
+
+    int first = 1, failed = 0;
+    for(int d=0; d<NDIST; d++){
+        if(!cli.dist_on[d]) continue;
+        for(uint32_t gi=0; gi<cli.ngeoms; gi++){
+            const geom_t* g = &cli.geoms[gi];
+            char dir[2048], img_a[2100], img_b[2100];
+            snprintf(dir, sizeof(dir), "%s/%s-%uk-%ui", workdir, DISTS[d], g->size_kib, g->inodes);
+            if(mkdir(dir, 0755)!=0 && errno!=EEXIST){ perror(dir); free(files); return 1; }
+            uint64_t payload;
+            rng_state = (cli.seed ? cli.seed : 1) + (uint64_t)d;  // same file set for every geometry
+            uint32_t n = gen_files(dir, d, cli.files, g, files, &payload);
+            if(n < cli.files)
+                fprintf(stderr,"%s: only %u of %u files fit %uk/%u inodes\n",
+                        DISTS[d], n, cli.files, g->size_kib, g->inodes);
+            snprintf(img_a, sizeof(img_a), "%s.a.img", dir);
+            snprintf(img_b, sizeof(img_b), "%s.b.img", dir);
+            const uint64_t img_bytes = (uint64_t)g->size_kib * 1024u;
+            char kib[16], ino[16];
+            snprintf(kib, sizeof(kib), "%u", g->size_kib);
+            snprintf(ino, sizeof(ino), "%u", g->inodes);
+
+            // 1) one mkfs_builder --from-dir run
+            row_t r1 = { "builder_from_dir", DISTS[d], *g, n, payload, img_bytes, {0,0,0} };
+            char* a1[] = { (char*)cli.builder, "--image", img_a, "--size-kib", kib, "--inodes", ino,
+                           "--from-dir", dir, NULL };
+            run_tool(a1, &r1.run);
+            print_row(&cli, &r1, first); first = 0;
+
+            // 2) empty mkfs_builder then one mkfs_adder per file, ping-ponging two images
+            row_t r2 = { "builder_then_adder", DISTS[d], *g, n, payload, img_bytes, {0,0,0} };
+            char* a2[] = { (char*)cli.builder, "--image", img_a, "--size-kib", kib, "--inodes", ino, NULL };
+            if(run_tool(a2, &r2.run)==0){
+                for(uint32_t i=0;i<n;i++){
+                    char* in  = (i & 1) ? img_b : img_a;
+                    char* out = (i & 1) ? img_a : img_b;
+                    char* a3[] = { (char*)cli.adder, "--input", in, "--output", out, "--file", files[i].path, NULL };
+                    if(run_tool(a3, &r2.run)!=0) break;
+                    r2.image_bytes_written += img_bytes;
+                }
+            }
+            print_row(&cli, &r2, 0);
+            if(r1.run.rc || r2.run.rc) failed = 1;
+
+            if(!cli.keep){
+                for(uint32_t i=0;i<n;i++) unlink(files[i].path);
+                unlink(img_a); unlink(img_b); rmdir(dir);
+            }
+        }
+    }
+    if(!strcmp(cli.format,"json")) printf(first ? "[]\n" : "\n]\n");
+    if(!cli.keep && !cli.workdir) rmdir(workdir);
+    free(files);
+    return failed ? 1 : 0;
+}
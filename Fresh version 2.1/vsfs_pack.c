@@ -0,0 +1,366 @@
+// vsfs_pack.c - pack a MiniVSFS image into the read-only compressed format (.mvsp)
+// build: gcc -O2 -std=c17 -Wall -Wextra vsfs_pack.c -o vsfs_pack
+// run:   ./vsfs_pack --input fs.img --output fs.mvsp [--chunk-kib 64]
+//        ./vsfs_pack --input fs.img --objstore DIR [--chunk-kib 64]
+//
+// Layout of a .mvsp file:
+//   header (64 B)
+//   chunk payloads, back to back
+//   chunk index: nchunks x pack_chunk_t, at header.index_off
+// Chunk 0 holds the metadata region (superblock, bitmaps, inode table);
+// chunk c >= 1 holds data blocks [(c-1)*chunk_blocks, c*chunk_blocks) of the
+// data region. Any block maps to its chunk with one division, and each chunk
+// decodes on its own. Free data blocks are zeroed before compression so they
+// cost almost nothing. vsfs_cat reads .mvsp files directly.
+//
+// --objstore writes a stand-in for an object store instead: DIR/manifest
+// plus one object per chunk_blocks of the image (DIR/%08u.blk, raw bytes,
+// all-zero objects left out). vsfs_cat reads such a directory as an image.
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define BS 4096u
+
+#pragma pack(push, 1)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must be 116 bytes");
+
+//  .mvsp on-disk structures (same definitions in vsfs_cat.c)
+
+#define PACK_MAGIC   0x5053564Du   // "MVSP"
+#define PACK_VERSION 1u
+enum { PACK_STORED, PACK_LZ, PACK_ZERO };
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t chunk_blocks;     // data blocks per chunk
+    uint64_t total_blocks;     // of the source image
+    uint64_t meta_blocks;      // blocks in chunk 0 (= data_region_start)
+    uint64_t nchunks;
+    uint64_t index_off;
+    uint32_t index_crc;        // crc32 of the chunk index
+    uint8_t  pad[8];
+    uint32_t header_crc;       // crc32 of the first 60 bytes
+} pack_hdr_t;
+
+typedef struct {
+    uint64_t off;              // payload offset in the file
+    uint32_t clen;             // payload bytes
+    uint32_t crc;              // crc32 of the decoded chunk
+    uint32_t method;           // PACK_*
+} pack_chunk_t;
+#pragma pack(pop)
+_Static_assert(sizeof(pack_hdr_t) == 64, "pack header must be 64 bytes");
+_Static_assert(sizeof(pack_chunk_t) == 20, "pack chunk entry must be 20 bytes");
+
+static uint32_t CRC32_TAB[256];
+static void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        CRC32_TAB[i]=c;
+    }
+}
+static uint32_t crc32(const void* data, size_t n){
+    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+static inline int test_bit(const uint8_t* bmap, uint32_t idx){
+    return (bmap[idx >> 3] >> (idx & 7)) & 1u;
+}
+
+//  LZ: byte-oriented LZ77 in the LZ4 style. A sequence is
+//    token (literal len << 4 | match len - 4), [len extension bytes],
+//    literals, match offset (u16 LE), [match len extension bytes]
+//  Lengths of 15 continue with bytes that add up (255 = keep going).
+//  The last sequence is literals only.
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+
+static uint32_t lz_hash(const uint8_t* p){
+    uint32_t v; memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t* lz_put_len(uint8_t* op, size_t len){
+    for(; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Returns the compressed size, or 0 if it would not fit in cap
+static size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap){
+    static uint32_t table[1u << LZ_HASH_BITS];     // position + 1, 0 = empty
+    memset(table, 0, sizeof(table));
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + n;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    while(n >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH){
+        uint32_t h = lz_hash(ip);
+        const uint8_t* ref = table[h] ? src + table[h] - 1 : NULL;
+        table[h] = (uint32_t)(ip - src) + 1;
+        if(!ref || ip - ref > 65535 || memcmp(ref, ip, LZ_MIN_MATCH)){ ip++; continue; }
+
+        size_t mlen = LZ_MIN_MATCH;
+        while(ip + mlen < end && ref[mlen] == ip[mlen]) mlen++;
+        size_t lit = (size_t)(ip - anchor);
+        // worst case: token + length bytes + literals + offset + length bytes
+        if((size_t)(oend - op) < 1 + lit/255 + 1 + lit + 2 + mlen/255 + 1) return 0;
+
+        uint8_t* token = op++;
+        *token = (uint8_t)((lit < 15 ? lit : 15) << 4);
+        if(lit >= 15) op = lz_put_len(op, lit - 15);
+        memcpy(op, anchor, lit); op += lit;
+        uint16_t off = (uint16_t)(ip - ref);
+        *op++ = (uint8_t)off; *op++ = (uint8_t)(off >> 8);
+        size_t m = mlen - LZ_MIN_MATCH;
+        *token |= (uint8_t)(m < 15 ? m : 15);
+        if(m >= 15) op = lz_put_len(op, m - 15);
+
+        ip += mlen;
+        anchor = ip;
+    }
+
+    size_t lit = (size_t)(end - anchor);
+    if((size_t)(oend - op) < 1 + lit/255 + 1 + lit) return 0;
+    *op++ = (uint8_t)((lit < 15 ? lit : 15) << 4);
+    if(lit >= 15) op = lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit); op += lit;
+    return (size_t)(op - dst);
+}
+
+// Returns the decoded size, or -1 on corrupt input
+static long lz_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap){
+    const uint8_t* ip = src;
+    const uint8_t* end = src + n;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+    while(ip < end){
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if(lit == 15){
+            uint8_t b;
+            do { if(ip >= end) return -1; b = *ip++; lit += b; } while(b == 255);
+        }
+        if((size_t)(end - ip) < lit || (size_t)(oend - op) < lit) return -1;
+        memcpy(op, ip, lit); op += lit; ip += lit;
+        if(ip == end) break;
+
+        if(end - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t mlen = (token & 15u);
+        if(mlen == 15){
+            uint8_t b;
+            do { if(ip >= end) return -1; b = *ip++; mlen += b; } while(b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if(!off || off > (size_t)(op - dst) || (size_t)(oend - op) < mlen) return -1;
+        const uint8_t* ref = op - off;
+        for(size_t i=0;i<mlen;i++) op[i] = ref[i];     // may overlap
+        op += mlen;
+    }
+    return (long)(op - dst);
+}
+
+typedef struct { const char* in_img; const char* out; const char* objstore; uint32_t chunk_kib; } cli_t;
+
+static int parse_cli(int argc, char** argv, cli_t* c){
+    memset(c, 0, sizeof(*c));
+    c->chunk_kib = 64;
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"--input") && i+1<argc) c->in_img = argv[++i];
+        else if(!strcmp(argv[i],"--output") && i+1<argc) c->out = argv[++i];
+        else if(!strcmp(argv[i],"--objstore") && i+1<argc) c->objstore = argv[++i];
+        else if(!strcmp(argv[i],"--chunk-kib") && i+1<argc) c->chunk_kib = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else { fprintf(stderr,"Unknown/invalid arg: %s\n", argv[i]); return -1; }
+    }
+    if(!c->in_img || !c->out == !c->objstore){
+        fprintf(stderr,"Usage: --input <img> (--output <file.mvsp> | --objstore <dir>) [--chunk-kib 4..1024]\n");
+        return -1;
+    }
+    if(c->chunk_kib < 4 || c->chunk_kib > 1024 || c->chunk_kib % 4){
+        fprintf(stderr,"--chunk-kib must be a multiple of 4 in 4..1024\n"); return -1;
+    }
+    return 0;
+}
+
+// Raw objects of chunk_blocks each; the reader treats a missing object as zeros
+static int write_objstore(const char* dir, const uint8_t* img, uint64_t total_blocks, uint32_t chunk_blocks){
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST){ perror("mkdir --objstore"); return 1; }
+    uint64_t nobj = (total_blocks + chunk_blocks - 1) / chunk_blocks, written = 0, bytes = 0;
+    char path[4096], tmp[4096];
+    // Rewriting an existing store: drop its manifest before any object changes,
+    // so readers see no store at all rather than old metadata over new chunks
+    snprintf(path, sizeof(path), "%s/manifest", dir);
+    if(remove(path) != 0 && errno != ENOENT){ perror(path); return 1; }
+    for(uint64_t o=0;o<nobj;o++){
+        uint64_t first = o * chunk_blocks;
+        uint64_t nblk = first + chunk_blocks > total_blocks ? total_blocks - first : chunk_blocks;
+        const uint8_t* raw = img + BS * first;
+        size_t len = (size_t)(nblk * BS), z = 0;
+        while(z < len && !raw[z]) z++;
+        snprintf(path, sizeof(path), "%s/%08" PRIu64 ".blk", dir, o);
+        if(z == len){ remove(path); continue; }   // stale object from an earlier run
+        FILE* f = fopen(path, "wb");
+        if(!f){ perror(path); return 1; }
+        size_t w = fwrite(raw, 1, len, f);
+        if(fclose(f) != 0 || w != len){ fprintf(stderr,"Short write on %s\n", path); return 1; }
+        written++; bytes += len;
+    }
+    // manifest last, renamed into place: a reader never sees a half-written store as complete
+    snprintf(path, sizeof(path), "%s/manifest", dir);
+    snprintf(tmp, sizeof(tmp), "%s/manifest.tmp", dir);
+    FILE* f = fopen(tmp, "w");
+    if(!f){ perror(tmp); return 1; }
+    fprintf(f, "mvsfs-objstore 1\ntotal_blocks %" PRIu64 "\nchunk_blocks %u\n", total_blocks, chunk_blocks);
+    if(fclose(f) != 0 || rename(tmp, path) != 0){ perror(path); remove(tmp); return 1; }
+    fprintf(stdout,"Wrote '%s': %" PRIu64 " of %" PRIu64 " objects (%" PRIu64 " bytes), %u blocks each\n",
+            dir, written, nobj, bytes, chunk_blocks);
+    return 0;
+}
+
+int main(int argc, char** argv){
+    crc32_init();
+    cli_t cli; if(parse_cli(argc, argv, &cli)!=0) return 2;
+
+    FILE* fi = fopen(cli.in_img, "rb");
+    if(!fi){ perror("fopen input"); return 1; }
+    if(fseek(fi, 0, SEEK_END) != 0){ perror("fseek"); fclose(fi); return 1; }
+    long sz = ftell(fi);
+    rewind(fi);
+    if(sz <= 0 || sz % BS){ fprintf(stderr,"Invalid image (size not multiple of block size)\n"); fclose(fi); return 1; }
+    uint8_t* img = (uint8_t*)malloc((size_t)sz);
+    if(!img){ fclose(fi); return 1; }
+    size_t got = fread(img, 1, (size_t)sz, fi);
+    fclose(fi);
+    if(got != (size_t)sz){ fprintf(stderr,"Short read on input image\n"); free(img); return 1; }
+
+    const uint64_t total_blocks = (uint64_t)sz / BS;
+    superblock_t* sb = (superblock_t*)img;
+    if(sb->magic != 0x4D565346u || sb->version != 1 || sb->block_size != BS || sb->total_blocks != total_blocks ||
+       sb->data_region_start + sb->data_region_blocks > total_blocks){
+        fprintf(stderr,"Not a MiniVSFS image\n"); free(img); return 3;
+    }
+
+    // free data blocks may hold stale bytes; they read back as zeros
+    const uint8_t* dbmap = img + BS * sb->data_bitmap_start;
+    uint64_t zeroed = 0;
+    for(uint32_t i=0;i<(uint32_t)sb->data_region_blocks;i++){
+        if(test_bit(dbmap, i)) continue;
+        memset(img + BS * (sb->data_region_start + i), 0, BS);
+        zeroed++;
+    }
+
+    const uint32_t chunk_blocks = cli.chunk_kib / 4;
+    if(cli.objstore){
+        int orc = write_objstore(cli.objstore, img, total_blocks, chunk_blocks);
+        free(img);
+        return orc;
+    }
+    const uint64_t meta_blocks = sb->data_region_start;
+    const uint64_t data_blocks = total_blocks - meta_blocks;
+    const uint64_t nchunks = 1 + (data_blocks + chunk_blocks - 1) / chunk_blocks;
+    size_t max_chunk = (size_t)(meta_blocks > chunk_blocks ? meta_blocks : chunk_blocks) * BS;
+
+    pack_chunk_t* idx = (pack_chunk_t*)calloc(nchunks, sizeof(*idx));
+    uint8_t* cbuf = (uint8_t*)malloc(max_chunk);
+    uint8_t* check = (uint8_t*)malloc(max_chunk);
+    FILE* fo = fopen(cli.out, "wb");
+    int rc = 0;
+    if(!idx || !cbuf || !check){ rc = 1; goto out; }
+    if(!fo){ perror("fopen output"); rc = 1; goto out; }
+
+    pack_hdr_t hdr; memset(&hdr, 0, sizeof(hdr));
+    if(fwrite(&hdr, sizeof(hdr), 1, fo) != 1){ rc = 1; goto out; }     // rewritten at the end
+    uint64_t off = sizeof(hdr);
+    uint64_t n_by_method[3] = {0, 0, 0};
+    for(uint64_t c=0;c<nchunks;c++){
+        uint64_t first = c ? meta_blocks + (c-1) * chunk_blocks : 0;
+        uint64_t nblk = c ? chunk_blocks : meta_blocks;
+        if(first + nblk > total_blocks) nblk = total_blocks - first;
+        const uint8_t* raw = img + BS * first;
+        size_t ulen = (size_t)(nblk * BS);
+
+        size_t z = 0;
+        while(z < ulen && !raw[z]) z++;
+        idx[c].off = off;
+        idx[c].crc = crc32(raw, ulen);
+        const uint8_t* payload = raw;
+        if(z == ulen){ idx[c].method = PACK_ZERO; idx[c].clen = 0; }
+        else {
+            size_t clen = lz_compress(raw, ulen, cbuf, ulen - 1);
+            if(clen && lz_decompress(cbuf, clen, check, ulen) == (long)ulen && !memcmp(check, raw, ulen)){
+                idx[c].method = PACK_LZ; idx[c].clen = (uint32_t)clen; payload = cbuf;
+            } else {
+                idx[c].method = PACK_STORED; idx[c].clen = (uint32_t)ulen;
+            }
+        }
+        n_by_method[idx[c].method]++;
+        if(idx[c].clen && fwrite(payload, 1, idx[c].clen, fo) != idx[c].clen){ perror("write"); rc = 1; goto out; }
+        off += idx[c].clen;
+    }
+
+    hdr.magic = PACK_MAGIC;
+    hdr.version = PACK_VERSION;
+    hdr.block_size = BS;
+    hdr.chunk_blocks = chunk_blocks;
+    hdr.total_blocks = total_blocks;
+    hdr.meta_blocks = meta_blocks;
+    hdr.nchunks = nchunks;
+    hdr.index_off = off;
+    hdr.index_crc = crc32(idx, nchunks * sizeof(*idx));
+    hdr.header_crc = crc32(&hdr, offsetof(pack_hdr_t, header_crc));
+    if(fwrite(idx, sizeof(*idx), nchunks, fo) != nchunks || fseek(fo, 0, SEEK_SET) != 0 ||
+       fwrite(&hdr, sizeof(hdr), 1, fo) != 1){ perror("write"); rc = 1; goto out; }
+    off += nchunks * sizeof(*idx);
+
+    fprintf(stdout,"Packed '%s' -> '%s': %" PRIu64 " blocks in %" PRIu64 " chunks (%" PRIu64 " lz, %" PRIu64
+            " stored, %" PRIu64 " zero), %" PRIu64 " -> %" PRIu64 " bytes (%.1f%%), %" PRIu64 " free blocks zeroed\n",
+            cli.in_img, cli.out, total_blocks, nchunks, n_by_method[PACK_LZ], n_by_method[PACK_STORED],
+            n_by_method[PACK_ZERO], (uint64_t)sz, off, 100.0 * (double)off / (double)sz, zeroed);
+out:
+    if(fo && fclose(fo) != 0 && !rc){ perror("close output"); rc = 1; }
+    free(check); free(cbuf); free(idx); free(img);
+    return rc;
+}
@@ -0,0 +1,319 @@
+// vsfs_stat.c - free-space and fragmentation report for a MiniVSFS image
+// build: gcc -O2 -std=c17 -Wall -Wextra vsfs_stat.c -o vsfs_stat
+// run:   ./vsfs_stat --image <img> [--json]
+//
+// Reads the image once, front to back: superblock, bitmaps, inode table, then
+// the data region (only directory blocks are looked at there). Nothing is
+// seeked back to, so it also works on a pipe (--image -). On an --indirect
+// image whose files map blocks through reserved_0/reserved_1, the data region
+// is kept in memory so those files' pointer blocks can be walked after it.
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define DIRECT_MAX 12
+#define EXT_BUCKETS 11          // free-extent sizes 1, 2-3, 4-7, ... 1024+
+#define SB_FLAG_INDIRECT 0x2u   // regular files map blocks 12.. via reserved_0/reserved_1
+#define PTRS_PER_BLK (BS / 4u)
+
+#pragma pack(push, 1)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must be 116 bytes");
+
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[DIRECT_MAX];
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode must be 128 bytes");
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t inode_no;
+    uint8_t  type;
+    char     name[58];
+    uint8_t  checksum;
+} dirent64_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t) == 64, "dirent must be 64 bytes");
+
+static inline int test_bit(const uint8_t* bmap, uint32_t idx){
+    return (bmap[idx >> 3] >> (idx & 7)) & 1u;
+}
+
+typedef struct {
+    uint64_t ext_count[EXT_BUCKETS], ext_blocks[EXT_BUCKETS];
+    uint64_t free_blocks, free_extents, largest_free;
+    uint64_t files, files_with_data, fragments, fragmented_files, max_fragments;
+    uint64_t dirs;
+    uint64_t inodes_used, itbl_blocks_used;    // inode-table blocks holding at least one live inode
+    uint64_t bmap_mode_mismatch;               // bitmap bit and inode mode disagree
+    uint64_t dir_blocks, dirent_used, dirent_slots;
+} report_t;
+
+typedef struct { const char* image; int json; } cli_t;
+
+static int parse_cli(int argc, char** argv, cli_t* c){
+    memset(c, 0, sizeof(*c));
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"--image") && i+1<argc) c->image = argv[++i];
+        else if(!strcmp(argv[i],"--json")) c->json = 1;
+        else { fprintf(stderr,"Unknown/invalid arg: %s\n", argv[i]); return -1; }
+    }
+    if(!c->image){
+        fprintf(stderr,"Usage: --image <img|-> [--json]\n");
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t ext_bucket(uint64_t len){
+    uint32_t b = 0;
+    while(len > 1 && b < EXT_BUCKETS-1){ len >>= 1; b++; }
+    return b;
+}
+
+// Blocks of a file that don't follow the previous one start a new fragment
+typedef struct { uint32_t n, prev; } frag_t;
+static void frag_add(frag_t* fr, uint32_t b){
+    if(!b) return;
+    if(!fr->n || b != fr->prev + 1) fr->n++;
+    fr->prev = b;
+}
+
+static uint32_t fragments_of(const inode_t* ino){
+    frag_t fr = {0, 0};
+    for(int k=0;k<DIRECT_MAX;k++) frag_add(&fr, ino->direct[k]);
+    return fr.n;
+}
+
+// Pointer block b out of the buffered data region, NULL if it is not in there
+static const uint32_t* ptr_blk(const uint8_t* dreg, const superblock_t* sb, uint32_t b){
+    if(b < sb->data_region_start || b >= sb->data_region_start + sb->data_region_blocks) return NULL;
+    return (const uint32_t*)(dreg + (uint64_t)(b - sb->data_region_start) * BS);
+}
+
+// Walks the block map the way vsfs_cat's fs_bmap does: direct[], reserved_0,
+// then each second-level block of reserved_1. The pointer blocks count too, in
+// the order the builder lays them after the data: single, second-level, double.
+static uint32_t fragments_ind(const inode_t* ino, const uint8_t* dreg, const superblock_t* sb){
+    frag_t fr = {0, 0};
+    for(int k=0;k<DIRECT_MAX;k++) frag_add(&fr, ino->direct[k]);
+    const uint32_t* s = ino->reserved_0 ? ptr_blk(dreg, sb, ino->reserved_0) : NULL;
+    const uint32_t* d = ino->reserved_1 ? ptr_blk(dreg, sb, ino->reserved_1) : NULL;
+    if(s) for(uint32_t k=0;k<PTRS_PER_BLK;k++) frag_add(&fr, s[k]);
+    if(d) for(uint32_t j=0;j<PTRS_PER_BLK;j++){
+        const uint32_t* l2 = d[j] ? ptr_blk(dreg, sb, d[j]) : NULL;
+        if(l2) for(uint32_t k=0;k<PTRS_PER_BLK;k++) frag_add(&fr, l2[k]);
+    }
+    frag_add(&fr, ino->reserved_0);
+    if(d) for(uint32_t j=0;j<PTRS_PER_BLK;j++) frag_add(&fr, d[j]);
+    frag_add(&fr, ino->reserved_1);
+    return fr.n;
+}
+
+static void count_frags(report_t* r, uint32_t frags){
+    if(!frags) return;
+    r->files_with_data++;
+    r->fragments += frags;
+    if(frags > 1) r->fragmented_files++;
+    if(frags > r->max_fragments) r->max_fragments = frags;
+}
+
+static void print_report(const report_t* r, const superblock_t* sb, int json){
+    double frag_idx = r->free_blocks ? 1.0 - (double)r->largest_free / (double)r->free_blocks : 0.0;
+    double avg_frag = r->files_with_data ? (double)r->fragments / (double)r->files_with_data : 0.0;
+    double itbl_util = sb->inode_count ? 100.0 * (double)r->inodes_used / (double)sb->inode_count : 0.0;
+    double dir_util = r->dirent_slots ? 100.0 * (double)r->dirent_used / (double)r->dirent_slots : 0.0;
+    if(json){
+        printf("{\"total_blocks\":%" PRIu64 ",\"data_blocks\":%" PRIu64 ",\"free_blocks\":%" PRIu64
+               ",\"free_extents\":%" PRIu64 ",\"largest_free\":%" PRIu64 ",\"free_space_fragmentation\":%.4f"
+               ",\"free_extent_hist\":[",
+               sb->total_blocks, sb->data_region_blocks, r->free_blocks, r->free_extents, r->largest_free, frag_idx);
+        for(uint32_t b=0;b<EXT_BUCKETS;b++)
+            printf("%s{\"min\":%u,\"extents\":%" PRIu64 ",\"blocks\":%" PRIu64 "}",
+                   b?",":"", 1u << b, r->ext_count[b], r->ext_blocks[b]);
+        printf("],\"files\":%" PRIu64 ",\"dirs\":%" PRIu64 ",\"avg_fragments_per_file\":%.3f"
+               ",\"fragmented_files\":%" PRIu64 ",\"max_fragments\":%" PRIu64
+               ",\"inodes\":%" PRIu64 ",\"inodes_used\":%" PRIu64 ",\"inode_table_util_pct\":%.2f"
+               ",\"inode_table_blocks\":%" PRIu64 ",\"inode_table_blocks_used\":%" PRIu64
+               ",\"bitmap_mode_mismatch\":%" PRIu64
+               ",\"dir_blocks\":%" PRIu64 ",\"dirents_used\":%" PRIu64 ",\"dirent_slots\":%" PRIu64
+               ",\"dir_block_util_pct\":%.2f}\n",
+               r->files, r->dirs, avg_frag, r->fragmented_files, r->max_fragments,
+               sb->inode_count, r->inodes_used, itbl_util, sb->inode_table_blocks, r->itbl_blocks_used,
+               r->bmap_mode_mismatch, r->dir_blocks, r->dirent_used, r->dirent_slots, dir_util);
+        return;
+    }
+    printf("data region: %" PRIu64 " blocks, %" PRIu64 " free (%.1f%%)\n", sb->data_region_blocks, r->free_blocks,
+           sb->data_region_blocks ? 100.0 * (double)r->free_blocks / (double)sb->data_region_blocks : 0.0);
+    printf("free extents: %" PRIu64 ", largest %" PRIu64 " blocks, fragmentation %.3f (1 - largest/free)\n",
+           r->free_extents, r->largest_free, frag_idx);
+    printf("free extent sizes:%s\n", r->free_extents ? "" : " none");
+    for(uint32_t b=0;b<EXT_BUCKETS;b++){
+        if(!r->ext_count[b]) continue;
+        char lo[32];
+        if(b == 0) snprintf(lo, sizeof(lo), "1");
+        else if(b == EXT_BUCKETS-1) snprintf(lo, sizeof(lo), "%u+", 1u << b);
+        else snprintf(lo, sizeof(lo), "%u-%u", 1u << b, (2u << b) - 1);
+        printf("  %-10s %6" PRIu64 " extents %8" PRIu64 " blocks\n", lo, r->ext_count[b], r->ext_blocks[b]);
+    }
+    printf("files: %" PRIu64 " (%" PRIu64 " with data), avg %.3f fragments/file, %" PRIu64
+           " fragmented, max %" PRIu64 "\n", r->files, r->files_with_data, avg_frag, r->fragmented_files,
+           r->max_fragments);
+    printf("inode table: %" PRIu64 "/%" PRIu64 " inodes used (%.1f%%), %" PRIu64 "/%" PRIu64
+           " table blocks hold live inodes\n", r->inodes_used, sb->inode_count, itbl_util,
+           r->itbl_blocks_used, sb->inode_table_blocks);
+    if(r->bmap_mode_mismatch)
+        printf("inode table: %" PRIu64 " inodes where bitmap and mode disagree\n", r->bmap_mode_mismatch);
+    printf("directories: %" PRIu64 ", %" PRIu64 " blocks, %" PRIu64 "/%" PRIu64 " dirent slots used (%.1f%%)\n",
+           r->dirs, r->dir_blocks, r->dirent_used, r->dirent_slots, dir_util);
+}
+
+int main(int argc, char** argv){
+    cli_t cli; if(parse_cli(argc, argv, &cli)!=0) return 2;
+    FILE* f = strcmp(cli.image, "-") ? fopen(cli.image, "rb") : stdin;
+    if(!f){ perror("fopen image"); return 1; }
+
+    uint8_t* blk = (uint8_t*)malloc(BS);
+    if(!blk){ fclose(f); return 1; }
+    if(fread(blk, BS, 1, f) != 1){ fprintf(stderr,"Short read on superblock\n"); free(blk); fclose(f); return 1; }
+    superblock_t sb; memcpy(&sb, blk, sizeof(sb));
+    if(sb.magic != 0x4D565346u || sb.block_size != BS || sb.inode_bitmap_start != 1 || sb.data_bitmap_start != 2 ||
+       sb.inode_table_start != 3 || sb.data_region_start != sb.inode_table_start + sb.inode_table_blocks ||
+       sb.data_region_start + sb.data_region_blocks > sb.total_blocks ||
+       sb.inode_count > (uint64_t)BS * 8 || sb.data_region_blocks > (uint64_t)BS * 8){
+        fprintf(stderr,"Not a MiniVSFS image\n"); free(blk); fclose(f); return 3;
+    }
+
+    report_t r; memset(&r, 0, sizeof(r));
+    uint8_t* ibmap = (uint8_t*)malloc(BS);
+    uint8_t* dbmap = (uint8_t*)malloc(BS);
+    // dir_at[i]: data-region block i belongs to a directory (filled from the inode table)
+    uint8_t* dir_at = (uint8_t*)calloc(sb.data_region_blocks ? sb.data_region_blocks : 1, 1);
+    // files whose block map goes past direct[]; counted once the data region is in dreg
+    inode_t* pend = NULL; uint64_t npend = 0;
+    uint8_t* dreg = NULL;
+    int rc = 0;
+    if(!ibmap || !dbmap || !dir_at){ rc = 1; goto out; }
+    if(fread(ibmap, BS, 1, f) != 1 || fread(dbmap, BS, 1, f) != 1){
+        fprintf(stderr,"Short read on bitmaps\n"); rc = 1; goto out;
+    }
+
+    // free extents straight off data_bmap
+    uint64_t run = 0;
+    for(uint32_t i=0;i<=(uint32_t)sb.data_region_blocks;i++){
+        if(i < sb.data_region_blocks && !test_bit(dbmap, i)){ run++; r.free_blocks++; continue; }
+        if(run){
+            uint32_t b = ext_bucket(run);
+            r.ext_count[b]++; r.ext_blocks[b] += run;
+            r.free_extents++;
+            if(run > r.largest_free) r.largest_free = run;
+        }
+        run = 0;
+    }
+
+    // inode table: fragments per file, table utilization, which data blocks are directories
+    for(uint64_t t=0;t<sb.inode_table_blocks;t++){
+        if(fread(blk, BS, 1, f) != 1){ fprintf(stderr,"Short read on inode table\n"); rc = 1; goto out; }
+        int live_here = 0;
+        for(uint32_t k=0;k<BS/INODE_SIZE;k++){
+            uint64_t idx = t * (BS/INODE_SIZE) + k;
+            if(idx >= sb.inode_count) break;
+            const inode_t* ino = (const inode_t*)(blk + k*INODE_SIZE);
+            int used = test_bit(ibmap, (uint32_t)idx);
+            if(used != (ino->mode != 0)) r.bmap_mode_mismatch++;
+            if(!used) continue;
+            r.inodes_used++; live_here = 1;
+            if((ino->mode & 0170000) == 0040000){
+                r.dirs++;
+                for(int d=0;d<DIRECT_MAX;d++){
+                    uint32_t b = ino->direct[d];
+                    if(b >= sb.data_region_start && b < sb.data_region_start + sb.data_region_blocks){
+                        dir_at[b - sb.data_region_start] = 1;
+                        r.dir_blocks++;
+                    }
+                }
+                continue;
+            }
+            r.files++;
+            if((sb.flags & SB_FLAG_INDIRECT) && (ino->reserved_0 || ino->reserved_1)){
+                if(!pend && !(pend = (inode_t*)malloc(sb.inode_count * sizeof(inode_t)))){ rc = 1; goto out; }
+                pend[npend++] = *ino;
+                continue;
+            }
+            count_frags(&r, fragments_of(ino));
+        }
+        r.itbl_blocks_used += live_here;
+    }
+
+    // data region, in order; only directory blocks are decoded
+    if(npend && !(dreg = (uint8_t*)malloc(sb.data_region_blocks * BS))){
+        fprintf(stderr,"Out of memory buffering the data region\n"); rc = 1; goto out;
+    }
+    for(uint64_t i=0;i<sb.data_region_blocks;i++){
+        uint8_t* b = dreg ? dreg + i * BS : blk;
+        if(fread(b, BS, 1, f) != 1){ fprintf(stderr,"Short read on data region\n"); rc = 1; goto out; }
+        if(!dir_at[i]) continue;
+        const dirent64_t* de = (const dirent64_t*)b;
+        for(uint32_t s=0;s<BS/sizeof(dirent64_t);s++) r.dirent_used += de[s].inode_no != 0;
+        r.dirent_slots += BS/sizeof(dirent64_t);
+    }
+    for(uint64_t i=0;i<npend;i++) count_frags(&r, fragments_ind(&pend[i], dreg, &sb));
+
+    print_report(&r, &sb, cli.json);
+out:
+    free(dreg); free(pend); free(dir_at); free(dbmap); free(ibmap); free(blk);
+    if(f != stdin) fclose(f);
+    return rc;
+}
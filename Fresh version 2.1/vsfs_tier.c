@@ -0,0 +1,471 @@
+// vsfs_tier.c - split a MiniVSFS image across a fast and a slow backing file
+// build: gcc -O2 -std=c17 -Wall -Wextra vsfs_tier.c -o vsfs_tier
+// run:   ./vsfs_tier --input fs.img --fast fs.fast --slow fs.slow --fast-kib 512
+//        ./vsfs_tier --fast fs.fast --migrate access.trace [--watch SEC]
+//        ./vsfs_tier --fast fs.fast --status
+//
+// The slow file is a full copy of the image: every block has a home there.
+// The fast file holds the metadata region and the hottest data blocks:
+//   tier_hdr_t (256 B) | remap table 0 | remap table 1 | pad to BS | slots
+// (each remap table has one u32 per image block; the header names the live one)
+// table[b] == 0 means block b is read from the slow file at b*BS;
+// table[b] == s+1 means it is in fast slot s. Metadata blocks are pinned to
+// the fast file. --migrate ranks data blocks by access count from a vsfs_cat
+// --trace-blocks file and moves the top ones into the fast file (and the rest
+// out); --watch keeps doing that as the trace grows, with counts halving
+// every pass so old heat fades. vsfs_cat opens the fast file as an image.
+//
+// vsfs_cat holds flock(LOCK_SH) on the fast file while it has it open, and a
+// migration pass runs under LOCK_EX. A slot that an open reader's table still
+// names is therefore never refilled under it: the pass waits for readers to
+// close, and readers that open during a pass wait for it to finish.
+//
+// A tier set is read-only: mkfs_adder doesn't write to it. Rebuild from the
+// image and split again to change files.
+#define _FILE_OFFSET_BITS 64
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#define BS 4096u
+
+#pragma pack(push, 1)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+
+
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must be 116 bytes");
+
+//  Tier set structures (same definitions in vsfs_cat.c)
+
+#define TIER_MAGIC   0x5253564Du   // "MVSR"
+#define TIER_VERSION 2u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t fast_slots;       // data slots in the fast file
+    uint64_t total_blocks;     // of the image
+    uint64_t meta_blocks;      // pinned to the fast file (= data_region_start)
+    uint64_t epoch;            // migration passes so far
+    uint32_t table_crc;        // crc32 of the live remap table
+    uint32_t table_copy;       // which remap table is live (0 or 1)
+    char     slow_path[204];   // relative paths are relative to the fast file
+    uint32_t header_crc;       // crc32 of the first 252 bytes
+} tier_hdr_t;
+#pragma pack(pop)
+_Static_assert(sizeof(tier_hdr_t) == 256, "tier header must be 256 bytes");
+
+//  Block access trace (written by vsfs_cat --trace-blocks)
+
+#define TRACE_MAGIC 0x5453564Du   // "MVST"
+#define TRACE_VERSION 1u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint64_t ts_ns;
+    uint32_t block;
+    uint16_t inode;
+    uint8_t  op;
+    uint8_t  pad;
+} trace_rec_t;
+#pragma pack(pop)
+_Static_assert(sizeof(trace_rec_t) == 16, "trace record must be 16 bytes");
+
+static uint32_t CRC32_TAB[256];
+static void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        CRC32_TAB[i]=c;
+    }
+}
+static uint32_t crc32(const void* data, size_t n){
+    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static int pread_full(int fd, void* buf, size_t n, uint64_t off){
+    uint8_t* p = (uint8_t*)buf;
+    size_t got = 0;
+    while(got < n){
+        ssize_t r = pread(fd, p + got, n - got, (off_t)(off + got));
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return -1;
+        got += (size_t)r;
+    }
+    return 0;
+}
+static int pwrite_full(int fd, const void* buf, size_t n, uint64_t off){
+    const uint8_t* p = (const uint8_t*)buf;
+    size_t put = 0;
+    while(put < n){
+        ssize_t r = pwrite(fd, p + put, n - put, (off_t)(off + put));
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return -1;
+        put += (size_t)r;
+    }
+    return 0;
+}
+
+static uint64_t table_blocks(uint64_t total_blocks){
+    return (sizeof(tier_hdr_t) + 2 * total_blocks * 4 + BS - 1) / BS;
+}
+
+// Byte offset of remap table c (0 or 1) in the fast file
+static uint64_t table_off(uint64_t total_blocks, uint32_t c){
+    return sizeof(tier_hdr_t) + c * total_blocks * 4;
+}
+
+typedef struct {
+    tier_hdr_t hdr;
+    uint32_t*  table;
+    int        fast_fd, slow_fd;
+    uint64_t   slot_base;      // byte offset of slot 0 in the fast file
+} tier_t;
+
+// The table goes to the copy the header doesn't name and is synced along with
+// any slot data written before; only then is the header switched over to it.
+// After a crash the header names either the old table or the new one, whole.
+static int tier_commit(tier_t* t){
+    tier_hdr_t* h = &t->hdr;
+    uint32_t next = !h->table_copy;
+    if(pwrite_full(t->fast_fd, t->table, h->total_blocks * 4, table_off(h->total_blocks, next)) != 0 ||
+       fdatasync(t->fast_fd) != 0){
+        perror("write tier table"); return -1;
+    }
+    h->table_crc = crc32(t->table, h->total_blocks * 4);
+    h->table_copy = next;
+    h->header_crc = crc32(h, offsetof(tier_hdr_t, header_crc));
+    if(pwrite_full(t->fast_fd, h, sizeof(*h), 0) != 0 || fsync(t->fast_fd) != 0){
+        perror("write tier header"); return -1;
+    }
+    return 0;
+}
+
+static int tier_flock(int fd, int op){
+    while(flock(fd, op) != 0){
+        if(errno != EINTR){ perror("flock --fast"); return -1; }
+    }
+    return 0;
+}
+
+// Opens the fast file and reads header and table under lock (LOCK_SH or
+// LOCK_EX), which stays held; the caller drops it
+static int tier_load(tier_t* t, const char* fast, int lock){
+    memset(t, 0, sizeof(*t));
+    t->slow_fd = -1;
+    t->fast_fd = open(fast, O_RDWR);
+    if(t->fast_fd < 0){ perror("open --fast"); return -1; }
+    if(tier_flock(t->fast_fd, lock) != 0){ close(t->fast_fd); return -1; }
+    tier_hdr_t* h = &t->hdr;
+    if(pread_full(t->fast_fd, h, sizeof(*h), 0) != 0 || h->magic != TIER_MAGIC || h->version != TIER_VERSION ||
+       h->block_size != BS || crc32(h, offsetof(tier_hdr_t, header_crc)) != h->header_crc ||
+       h->meta_blocks > h->fast_slots || h->meta_blocks > h->total_blocks || h->total_blocks > (1u << 24) ||
+       h->table_copy > 1){
+        fprintf(stderr,"Not a tier set: %s\n", fast); close(t->fast_fd); return -1;
+    }
+    t->table = (uint32_t*)malloc(h->total_blocks * 4);
+    if(!t->table ||
+       pread_full(t->fast_fd, t->table, h->total_blocks * 4, table_off(h->total_blocks, h->table_copy)) != 0 ||
+       crc32(t->table, h->total_blocks * 4) != h->table_crc){
+        fprintf(stderr,"Corrupt tier remap table\n"); free(t->table); close(t->fast_fd); return -1;
+    }
+    t->slot_base = table_blocks(h->total_blocks) * BS;
+
+    char path[4096];
+    h->slow_path[sizeof(h->slow_path)-1] = '\0';
+    const char* slash = strrchr(fast, '/');
+    if(h->slow_path[0] == '/' || !slash) snprintf(path, sizeof(path), "%s", h->slow_path);
+    else snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - fast), fast, h->slow_path);
+    t->slow_fd = open(path, O_RDONLY);
+    if(t->slow_fd < 0){ perror(path); free(t->table); close(t->fast_fd); return -1; }
+    return 0;
+}
+
+static void tier_close(tier_t* t){
+    free(t->table);
+    if(t->slow_fd >= 0) close(t->slow_fd);
+    close(t->fast_fd);
+}
+
+//  --input: split an image into a new tier set
+
+static int tier_split(const char* in, const char* fast, const char* slow, uint32_t fast_kib){
+    FILE* fi = fopen(in, "rb");
+    if(!fi){ perror("fopen input"); return 1; }
+    if(fseek(fi, 0, SEEK_END) != 0){ perror("fseek"); fclose(fi); return 1; }
+    long sz = ftell(fi);
+    rewind(fi);
+    if(sz <= 0 || sz % BS){ fprintf(stderr,"Invalid image (size not multiple of block size)\n"); fclose(fi); return 1; }
+    uint8_t* img = (uint8_t*)malloc((size_t)sz);
+    if(!img){ fclose(fi); return 1; }
+    size_t got = fread(img, 1, (size_t)sz, fi);
+    fclose(fi);
+    if(got != (size_t)sz){ fprintf(stderr,"Short read on input image\n"); free(img); return 1; }
+    const uint64_t total_blocks = (uint64_t)sz / BS;
+    const superblock_t* sb = (const superblock_t*)img;
+    if(sb->magic != 0x4D565346u || sb->block_size != BS || sb->total_blocks != total_blocks ||
+       sb->data_region_start > total_blocks){
+        fprintf(stderr,"Not a MiniVSFS image\n"); free(img); return 3;
+    }
+    uint32_t slots = fast_kib / 4;
+    if(slots < sb->data_region_start){
+        fprintf(stderr,"--fast-kib %u is smaller than the metadata region (%" PRIu64 " KiB)\n",
+                fast_kib, sb->data_region_start * 4);
+        free(img); return 2;
+    }
+    if(slots > total_blocks) slots = (uint32_t)total_blocks;
+
+    // the slow file: every block at its home offset
+    FILE* fs = fopen(slow, "wb");
+    if(!fs){ perror("fopen --slow"); free(img); return 1; }
+    size_t w = fwrite(img, BS, (size_t)total_blocks, fs);
+    if(fflush(fs) != 0 || fsync(fileno(fs)) != 0) w = 0;
+    if(fclose(fs) != 0 || w != total_blocks){ fprintf(stderr,"Short write on --slow\n"); free(img); return 1; }
+
+    tier_t t; memset(&t, 0, sizeof(t));
+    t.slow_fd = -1;
+    t.fast_fd = open(fast, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(t.fast_fd < 0){ perror("open --fast"); free(img); return 1; }
+    t.table = (uint32_t*)calloc(total_blocks, 4);
+    if(!t.table){ close(t.fast_fd); free(img); return 1; }
+    t.slot_base = table_blocks(total_blocks) * BS;
+    tier_hdr_t* h = &t.hdr;
+    h->magic = TIER_MAGIC; h->version = TIER_VERSION; h->block_size = BS;
+    h->fast_slots = slots;
+    h->total_blocks = total_blocks;
+    h->meta_blocks = sb->data_region_start;
+    // store the slow path as the fast file will see it: its base name if both
+    // live in the same directory, otherwise absolute
+    const char* fs_slash = strrchr(fast, '/');
+    const char* ss_slash = strrchr(slow, '/');
+    size_t fdir = fs_slash ? (size_t)(fs_slash - fast) : 0, sdir = ss_slash ? (size_t)(ss_slash - slow) : 0;
+    char abs_slow[4096];
+    const char* rel = ss_slash ? ss_slash + 1 : slow;
+    if(fdir != sdir || strncmp(fast, slow, fdir)){
+        if(!realpath(slow, abs_slow)){ perror("realpath --slow"); tier_close(&t); free(img); return 1; }
+        rel = abs_slow;
+    }
+    if(strlen(rel) >= sizeof(h->slow_path)){ fprintf(stderr,"--slow path too long\n"); tier_close(&t); free(img); return 2; }
+    strcpy(h->slow_path, rel);
+
+    int rc = 0;
+    for(uint64_t b=0;b<h->meta_blocks;b++){
+        if(pwrite_full(t.fast_fd, img + BS*b, BS, t.slot_base + b*BS) != 0){ perror("write --fast"); rc = 1; break; }
+        t.table[b] = (uint32_t)b + 1;
+    }
+    if(!rc && (ftruncate(t.fast_fd, (off_t)(t.slot_base + (uint64_t)slots * BS)) != 0 || fsync(t.fast_fd) != 0)){
+        perror("size --fast"); rc = 1;
+    }
+    if(!rc && tier_commit(&t) != 0) rc = 1;
+    if(!rc) fprintf(stdout,"Split '%s': %" PRIu64 " metadata blocks pinned in '%s' (%u slots, %" PRIu64
+                    " free for hot data), %" PRIu64 " blocks in '%s'\n", in, h->meta_blocks, fast, slots,
+                    slots - h->meta_blocks, total_blocks, slow);
+    free(t.table); close(t.fast_fd); free(img);
+    return rc;
+}
+
+//  --migrate: one pass = evict what's no longer hot, then promote the new hot set
+
+typedef struct { uint32_t block; double heat; } rank_t;
+
+static int by_heat_desc(const void* a, const void* b){
+    const rank_t* x = (const rank_t*)a; const rank_t* y = (const rank_t*)b;
+    if(x->heat != y->heat) return x->heat < y->heat ? 1 : -1;
+    return (x->block > y->block) - (x->block < y->block);
+}
+
+// Adds the trace records past *off to heat[]; restarts from the top if the file was replaced
+static int trace_accumulate(const char* path, uint64_t* off, double* heat, uint64_t total_blocks, uint64_t* nrec){
+    FILE* f = fopen(path, "rb");
+    if(!f){ perror("fopen --migrate"); return -1; }
+    uint32_t hdr[2];
+    if(fread(hdr, sizeof(hdr), 1, f) != 1 || hdr[0] != TRACE_MAGIC || hdr[1] != TRACE_VERSION){
+        fclose(f);
+        if(*off) return 0;      // being rewritten right now; try again next pass
+        fprintf(stderr,"Not a block trace: %s\n", path); return -1;
+    }
+    struct stat st;
+    if(fstat(fileno(f), &st) == 0 && (uint64_t)st.st_size < *off) *off = 0;
+    if(!*off) *off = sizeof(hdr);
+    if(fseeko(f, (off_t)*off, SEEK_SET) != 0){ fclose(f); return -1; }
+    trace_rec_t r;
+    while(fread(&r, sizeof(r), 1, f) == 1){
+        if(r.block < total_blocks) heat[r.block] += 1.0;
+        *off += sizeof(r);
+        (*nrec)++;
+    }
+    fclose(f);
+    return 0;
+}
+
+// Runs under LOCK_EX, so no reader has a table that names a slot it refills
+static int tier_migrate_pass(tier_t* t, const double* heat, uint64_t* promoted, uint64_t* evicted){
+    const tier_hdr_t* h = &t->hdr;
+    uint64_t cap = h->fast_slots - h->meta_blocks, n = 0;
+    rank_t* rk = (rank_t*)malloc((h->total_blocks - h->meta_blocks + 1) * sizeof(*rk));
+    uint8_t* want = (uint8_t*)calloc(h->total_blocks, 1);
+    uint8_t* used = (uint8_t*)calloc(h->fast_slots, 1);
+    uint8_t* buf = (uint8_t*)malloc(BS);
+    int rc = -1;
+    if(!rk || !want || !used || !buf) goto out;
+    for(uint64_t b=h->meta_blocks;b<h->total_blocks;b++)
+        if(heat[b] > 0) rk[n++] = (rank_t){ (uint32_t)b, heat[b] };
+    qsort(rk, n, sizeof(*rk), by_heat_desc);
+    for(uint64_t i=0;i<n && i<cap;i++) want[rk[i].block] = 1;
+
+    // evictions first; the slow copy is always current, so only the table changes
+    *promoted = *evicted = 0;
+    for(uint64_t b=h->meta_blocks;b<h->total_blocks;b++){
+        if(t->table[b] && !want[b]){ t->table[b] = 0; (*evicted)++; }
+    }
+    for(uint64_t b=0;b<h->total_blocks;b++) if(t->table[b]) used[t->table[b] - 1] = 1;
+    if(*evicted && tier_commit(t) != 0) goto out;       // freed slots are safe to reuse only after this
+
+    // promotions: copy into free slots; tier_commit syncs them before the table that names them
+    uint32_t slot = 0;
+    for(uint64_t b=h->meta_blocks;b<h->total_blocks;b++){
+        if(!want[b] || t->table[b]) continue;
+        while(slot < h->fast_slots && used[slot]) slot++;
+        if(slot == h->fast_slots) break;
+        if(pread_full(t->slow_fd, buf, BS, b*BS) != 0 || pwrite_full(t->fast_fd, buf, BS, t->slot_base + (uint64_t)slot*BS) != 0){
+            perror("migrate block"); goto out;
+        }
+        used[slot] = 1;
+        t->table[b] = slot + 1;
+        (*promoted)++;
+    }
+    t->hdr.epoch++;
+    if(tier_commit(t) != 0) goto out;
+    rc = 0;
+out:
+    free(buf); free(used); free(want); free(rk);
+    return rc;
+}
+
+// Takes LOCK_EX for one pass, saying so if open readers make it wait
+static int tier_lock_pass(tier_t* t, const char* fast){
+    if(flock(t->fast_fd, LOCK_EX | LOCK_NB) == 0) return 0;
+    if(errno != EWOULDBLOCK && errno != EINTR){ perror("flock --fast"); return -1; }
+    fprintf(stderr,"waiting for readers of '%s' to close\n", fast);
+    return tier_flock(t->fast_fd, LOCK_EX);
+}
+
+static int tier_migrate(const char* fast, const char* trace, uint32_t watch){
+    tier_t t;
+    if(tier_load(&t, fast, LOCK_SH) != 0) return 1;
+    flock(t.fast_fd, LOCK_UN);
+    double* heat = (double*)calloc(t.hdr.total_blocks, sizeof(*heat));
+    if(!heat){ tier_close(&t); return 1; }
+    uint64_t off = 0;
+    int rc = 0;
+    for(;;){
+        uint64_t nrec = 0, promoted = 0, evicted = 0;
+        if(trace_accumulate(trace, &off, heat, t.hdr.total_blocks, &nrec) != 0){ rc = 1; break; }
+        if(tier_lock_pass(&t, fast) != 0){ rc = 1; break; }
+        int prc = tier_migrate_pass(&t, heat, &promoted, &evicted);
+        flock(t.fast_fd, LOCK_UN);
+        if(prc != 0){ rc = 1; break; }
+        uint64_t in_fast = 0;
+        for(uint64_t b=t.hdr.meta_blocks;b<t.hdr.total_blocks;b++) in_fast += t.table[b] != 0;
+        fprintf(stdout,"epoch %" PRIu64 ": %" PRIu64 " new trace records, %" PRIu64 " promoted, %" PRIu64
+                " evicted, %" PRIu64 "/%" PRIu64 " hot slots used\n", t.hdr.epoch, nrec, promoted, evicted,
+                in_fast, (uint64_t)t.hdr.fast_slots - t.hdr.meta_blocks);
+        fflush(stdout);
+        if(!watch) break;
+        for(uint64_t b=0;b<t.hdr.total_blocks;b++) heat[b] *= 0.5;
+        struct timespec ts = { (time_t)watch, 0 };
+        nanosleep(&ts, NULL);
+    }
+    free(heat);
+    tier_close(&t);
+    return rc;
+}
+
+static int tier_status(const char* fast){
+    tier_t t;
+    if(tier_load(&t, fast, LOCK_SH) != 0) return 1;
+    uint64_t hot = 0;
+    for(uint64_t b=t.hdr.meta_blocks;b<t.hdr.total_blocks;b++) hot += t.table[b] != 0;
+    fprintf(stdout,"tier set '%s': %" PRIu64 " blocks, slow file '%s', epoch %" PRIu64 "\n"
+                   "fast: %u slots, %" PRIu64 " metadata, %" PRIu64 " hot data, %" PRIu64 " free\n",
+            fast, t.hdr.total_blocks, t.hdr.slow_path, t.hdr.epoch, t.hdr.fast_slots, t.hdr.meta_blocks, hot,
+            t.hdr.fast_slots - t.hdr.meta_blocks - hot);
+    tier_close(&t);
+    return 0;
+}
+
+typedef struct {
+    const char* in_img;
+    const char* fast;
+    const char* slow;
+    uint32_t    fast_kib;
+    const char* migrate;   // access trace
+    uint32_t    watch;     // seconds between passes, 0 = one pass
+    int         status;
+} cli_t;
+
+static int parse_cli(int argc, char** argv, cli_t* c){
+    memset(c, 0, sizeof(*c));
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"--input") && i+1<argc) c->in_img = argv[++i];
+        else if(!strcmp(argv[i],"--fast") && i+1<argc) c->fast = argv[++i];
+        else if(!strcmp(argv[i],"--slow") && i+1<argc) c->slow = argv[++i];
+        else if(!strcmp(argv[i],"--fast-kib") && i+1<argc) c->fast_kib = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if(!strcmp(argv[i],"--migrate") && i+1<argc) c->migrate = argv[++i];
+        else if(!strcmp(argv[i],"--watch") && i+1<argc) c->watch = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if(!strcmp(argv[i],"--status")) c->status = 1;
+        else { fprintf(stderr,"Unknown/invalid arg: %s\n", argv[i]); return -1; }
+    }
+    int modes = !!c->in_img + !!c->migrate + c->status;
+    if(!c->fast || modes != 1 || (c->in_img && (!c->slow || !c->fast_kib || c->fast_kib % 4))){
+        fprintf(stderr,"Usage: --input <img> --fast <file> --slow <file> --fast-kib N   (split)\n"
+                       "       --fast <file> --migrate <trace> [--watch SEC]           (migrate by access counts)\n"
+                       "       --fast <file> --status\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv){
+    crc32_init();
+    cli_t cli; if(parse_cli(argc, argv, &cli)!=0) return 2;
+    if(cli.in_img) return tier_split(cli.in_img, cli.fast, cli.slow, cli.fast_kib);
+    if(cli.migrate) return tier_migrate(cli.fast, cli.migrate, cli.watch);
+    return tier_status(cli.fast);
+}